@@ -10,9 +10,13 @@
 #include <Headers/kern_devinfo.hpp>
 #include <Headers/kern_version.hpp>
 #include <IOKit/IOCommandGate.h>
+#include <IOKit/IOMessage.h>
 #include <IOKit/IOTimerEventSource.h>
-#include <IOKit/IOLocks.h>
+#include <IOKit/IOUserClient.h>
+#include <kern/clock.h>
 
+#include "kern_smoother_core.hpp"
+#include "kern_smoother_curves.hpp"
 #include "kern_smoother.hpp"
 
 OSDefineMetaClassAndStructors(PRODUCT_NAME, IOService)
@@ -34,12 +38,6 @@ bool PRODUCT_NAME::start(IOService *provider) {
 		return false;
 	}
 
-	AppleBacklightSmootherNS::lockSmooth = IORecursiveLockAlloc();
-	if (!AppleBacklightSmootherNS::lockSmooth) {
-		SYSLOG("start", "failed to allocate lock");
-		return false;
-	}
-
 	AppleBacklightSmootherNS::workLoop = getWorkLoop();
 	if (!AppleBacklightSmootherNS::workLoop) {
 		SYSLOG("start", "failed to get workloop");
@@ -52,15 +50,56 @@ bool PRODUCT_NAME::start(IOService *provider) {
 		return false;
 	}
 
+	AppleBacklightSmootherNS::statisticsTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, nullptr, &PRODUCT_NAME::publishStatistics));
+	if (!AppleBacklightSmootherNS::statisticsTimer || AppleBacklightSmootherNS::workLoop->addEventSource(AppleBacklightSmootherNS::statisticsTimer) != kIOReturnSuccess) {
+		// Statistics are optional, smoothing works without them.
+		SYSLOG("start", "failed to create statistics timer");
+		OSSafeReleaseNULL(AppleBacklightSmootherNS::statisticsTimer);
+	}
+
+	AppleBacklightSmootherNS::prepareTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, nullptr, &PRODUCT_NAME::prepareControllers));
+	if (!AppleBacklightSmootherNS::prepareTimer || AppleBacklightSmootherNS::workLoop->addEventSource(AppleBacklightSmootherNS::prepareTimer) != kIOReturnSuccess) {
+		// Tables are built on the first PWM frequency write instead.
+		SYSLOG("start", "failed to create prepare timer");
+		OSSafeReleaseNULL(AppleBacklightSmootherNS::prepareTimer);
+	}
+
+	AppleBacklightSmootherNS::sleepWakeNotifier = registerPrioritySleepWakeInterest(AppleBacklightSmootherNS::sleepWakeHandler, this);
+	if (!AppleBacklightSmootherNS::sleepWakeNotifier) {
+		// Smoothing still works, fades may just run into sleep and wake.
+		SYSLOG("start", "failed to register for sleep and wake notifications");
+	}
+
+	SmootherCore::platform.scheduleTimer = AppleBacklightSmootherNS::scheduleSmoothTimer;
+	if (AppleBacklightSmootherNS::prepareTimer) {
+		SmootherCore::platform.schedulePrepare = AppleBacklightSmootherNS::schedulePrepare;
+		// Controllers may have been seen before the service started.
+		AppleBacklightSmootherNS::schedulePrepare();
+	}
+
 	return ADDPR(startSuccess);
 }
 
 void PRODUCT_NAME::stop(IOService *provider) {
 	ADDPR(selfInstance) = nullptr;
+	SmootherCore::platform.scheduleTimer = nullptr;
+	SmootherCore::platform.schedulePrepare = nullptr;
+	if (AppleBacklightSmootherNS::sleepWakeNotifier) {
+		AppleBacklightSmootherNS::sleepWakeNotifier->remove();
+		AppleBacklightSmootherNS::sleepWakeNotifier = nullptr;
+	}
+	if (AppleBacklightSmootherNS::prepareTimer) {
+		AppleBacklightSmootherNS::workLoop->removeEventSource(AppleBacklightSmootherNS::prepareTimer);
+		OSSafeReleaseNULL(AppleBacklightSmootherNS::prepareTimer);
+	}
 	if (AppleBacklightSmootherNS::smoothTimer) {
 		AppleBacklightSmootherNS::workLoop->removeEventSource(AppleBacklightSmootherNS::smoothTimer);
 		OSSafeReleaseNULL(AppleBacklightSmootherNS::smoothTimer);
 	}
+	if (AppleBacklightSmootherNS::statisticsTimer) {
+		AppleBacklightSmootherNS::workLoop->removeEventSource(AppleBacklightSmootherNS::statisticsTimer);
+		OSSafeReleaseNULL(AppleBacklightSmootherNS::statisticsTimer);
+	}
 	if (AppleBacklightSmootherNS::workLoop) {
 		OSSafeReleaseNULL(AppleBacklightSmootherNS::workLoop);
 	}
@@ -68,48 +107,266 @@ void PRODUCT_NAME::stop(IOService *provider) {
 }
 
 void PRODUCT_NAME::dischargeQueue() {
-	IORecursiveLockLock(AppleBacklightSmootherNS::lockSmooth);
-	while (!AppleBacklightSmootherNS::backlightQueue.isEmpty()) {
-#define IMIN(A, B) ((A < B) ? (A) : (B))
-#define IMAX(A, B) ((A > B) ? (A) : (B))
-		auto pair = AppleBacklightSmootherNS::backlightQueue.fetch();
-		if (pair.third > IMIN(AppleBacklightSmootherNS::currentBacklightValue, AppleBacklightSmootherNS::lastRequestedBacklightValue) &&
-			pair.third < IMAX(AppleBacklightSmootherNS::currentBacklightValue, AppleBacklightSmootherNS::lastRequestedBacklightValue)) {
-			AppleBacklightSmootherNS::orgWriteRegister32(pair.first, AppleBacklightSmootherNS::backlightDutyRegister, pair.second);
-			AppleBacklightSmootherNS::currentBacklightValue = pair.third;
-			DBGLOG("smoother", "dischargeQueue set backlight register 0x%x to %0x%x", AppleBacklightSmootherNS::backlightDutyRegister, pair.second);
+	SmootherCore::dischargeQueue();
+}
+
+void PRODUCT_NAME::prepareControllers() {
+	SmootherCore::prepareControllers();
+}
+
+IOReturn AppleBacklightSmootherNS::sleepWakeHandler(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize) {
+	// Run on the work loop so the timer is not in the middle of a tick.
+	switch (messageType) {
+		case kIOMessageSystemWillSleep:
+			workLoop->runAction([](OSObject *, void *, void *, void *, void *) -> IOReturn {
+				SmootherCore::systemWillSleep();
+				return kIOReturnSuccess;
+			}, nullptr);
+			break;
+		case kIOMessageSystemWillPowerOn:
+			workLoop->runAction([](OSObject *, void *, void *, void *, void *) -> IOReturn {
+				SmootherCore::systemDidWake();
+				return kIOReturnSuccess;
+			}, nullptr);
+			break;
+		default:
+			break;
+	}
+	return kIOReturnSuccess;
+}
+
+void AppleBacklightSmootherNS::scheduleSmoothTimer(uint32_t us) {
+	smoothTimer->setTimeoutUS(us);
+}
+
+void AppleBacklightSmootherNS::schedulePrepare() {
+	prepareTimer->setTimeoutMS(0);
+}
+
+uint64_t AppleBacklightSmootherNS::currentTimeNs() {
+	uint64_t ns;
+	absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+	return ns;
+}
+
+void PRODUCT_NAME::publishStatistics() {
+	AppleBacklightSmootherNS::statisticsPending = false;
+
+	OSDictionary *snapshot = OSDictionary::withCapacity(24);
+	if (!snapshot) {
+		return;
+	}
+
+	auto &statistics = SmootherCore::statistics;
+	AppleBacklightSmootherNS::setNumber(snapshot, "Retarget Count", statistics.retargetCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Queue Overflow Count", statistics.queueOverflowCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Stale Request Count", statistics.staleRequestCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Queue High Water", statistics.queueHighWater, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Tick Count", statistics.tickCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Transition Count", statistics.transitionCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Register Writes Issued", statistics.writesIssued, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Register Writes Elided", statistics.writesElided, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Catch Up Steps", statistics.catchUpSteps, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Plan Cache Hits", statistics.planCacheHits, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Plan Cache Misses", statistics.planCacheMisses, 32);
+	uint32_t plans = statistics.planCacheHits + statistics.planCacheMisses;
+	AppleBacklightSmootherNS::setNumber(snapshot, "Plan Cache Hit Rate", plans ? statistics.planCacheHits * 100ULL / plans : 0, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Applied Requests", statistics.appliedRequests, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Filtered Requests", statistics.filteredRequests, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Held Requests", statistics.heldRequests, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Wake Count", statistics.wakeCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Sleep Cancelled Transitions", statistics.sleepCancelCount, 32);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Last Wake To Backlight Latency", statistics.wakeLatencyLast, 64);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Last Tick Lateness", statistics.tickLatenessLast, 64);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Max Tick Lateness", statistics.tickLatenessMax, 64);
+	AppleBacklightSmootherNS::setNumber(snapshot, "Total Tick Lateness", statistics.tickLatenessTotal, 64);
+	AppleBacklightSmootherNS::setHistogram(snapshot, "Tick Lateness (us)", statistics.tickLateness.buckets, arrsize(statistics.tickLateness.buckets));
+	AppleBacklightSmootherNS::setHistogram(snapshot, "First Write Latency (us)", statistics.firstWriteLatency.buckets, arrsize(statistics.firstWriteLatency.buckets));
+	AppleBacklightSmootherNS::setHistogram(snapshot, "Final Write Latency (us)", statistics.finalWriteLatency.buckets, arrsize(statistics.finalWriteLatency.buckets));
+	AppleBacklightSmootherNS::setHistogram(snapshot, "Writes Per Transition", statistics.writesPerTransition.buckets, arrsize(statistics.writesPerTransition.buckets));
+	AppleBacklightSmootherNS::setHistogram(snapshot, "Wakeups Per Transition", statistics.wakeupsPerTransition.buckets, arrsize(statistics.wakeupsPerTransition.buckets));
+	AppleBacklightSmootherNS::setHistogram(snapshot, "Wake To Backlight Latency (us)", statistics.wakeLatency.buckets, arrsize(statistics.wakeLatency.buckets));
+
+	if (SmootherCore::traceEnabled) {
+		size_t size = SmootherCore::traceDumpSize();
+		void *buffer = IOMalloc(size);
+		if (buffer) {
+			OSData *trace = OSData::withBytes(buffer, static_cast<unsigned>(SmootherCore::dumpTrace(buffer, size)));
+			if (trace) {
+				snapshot->setObject("Register Trace", trace);
+				trace->release();
+			}
+			IOFree(buffer, size);
+		}
+	}
+
 #ifdef DEBUG
-			if (ADDPR(selfInstance)) {
-				ADDPR(selfInstance)->setProperty("Current Backlight Value", AppleBacklightSmootherNS::currentBacklightValue);
+	OSArray *controllersArray = OSArray::withCapacity(SmootherCore::MAX_CONTROLLERS);
+	for (auto &controller : SmootherCore::controllers) {
+		if (!controller.that || !controllersArray) {
+			continue;
+		}
+
+		OSDictionary *state = OSDictionary::withCapacity(5);
+		if (state) {
+			AppleBacklightSmootherNS::setNumber(state, "Last Requested Backlight Value", controller.lastRequestedBacklightValue, 32);
+			AppleBacklightSmootherNS::setNumber(state, "Current Backlight Value", controller.currentBacklightValue, 32);
+			AppleBacklightSmootherNS::setNumber(state, "Target Backlight Frequency", controller.targetBacklightFrequency, 32);
+			AppleBacklightSmootherNS::setNumber(state, "Target PWM Control", controller.targetPwmControl, 32);
+			AppleBacklightSmootherNS::setNumber(state, "Driver Backlight Frequency", controller.driverBacklightFrequency, 32);
+			controllersArray->setObject(state);
+			state->release();
+		}
+
+		auto table = controller.dutyTable;
+		if (!AppleBacklightSmootherNS::loggedFrequency && table) {
+			AppleBacklightSmootherNS::loggedFrequency = true;
+			OSArray *dutyTablesArray = AppleBacklightSmootherNS::makeNumberArray(table->values, SmootherCore::STEPS);
+			if (dutyTablesArray) {
+				setProperty("Duty Tables", dutyTablesArray);
+				dutyTablesArray->release();
 			}
+		}
+	}
+	if (controllersArray) {
+		snapshot->setObject("Controllers", controllersArray);
+		controllersArray->release();
+	}
 #endif
-			break;
+
+	setProperty("Smoother Statistics", snapshot);
+	snapshot->release();
+
+	// Counters the driver thread bumps without a tick, like filtered requests, still reach the next snapshot.
+	if (memcmp(&AppleBacklightSmootherNS::publishedStatistics, &statistics, sizeof(statistics)) != 0) {
+		AppleBacklightSmootherNS::publishedStatistics = statistics;
+		AppleBacklightSmootherNS::publishState();
+	}
+}
+
+IOReturn PRODUCT_NAME::setProperties(OSObject *properties) {
+	OSDictionary *dictionary = OSDynamicCast(OSDictionary, properties);
+	if (!dictionary) {
+		return kIOReturnBadArgument;
+	}
+
+	IOReturn result = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+	if (result != kIOReturnSuccess) {
+		return result;
+	}
+
+	// Same names and meaning as the boot-args.
+	auto update = SmootherCore::configuration;
+	uint32_t value;
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothcurve", value) && value != static_cast<uint32_t>(update.curve)) {
+		// The previous curve's parameter means something else for the new one.
+		update.curve = static_cast<SmootherCurve>(value);
+		update.curveParameter = 0;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothcurveparam", value)) {
+		update.curveParameter = value;
+	}
+	if (!SmootherCurves::isValid(update.curve, update.curveParameter)) {
+		SYSLOG("smoother", "setProperties: curve %u does not take parameter %u", static_cast<uint32_t>(update.curve), update.curveParameter);
+		return kIOReturnBadArgument;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothdur", value)) {
+		update.durationMs = value;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothwrites", value)) {
+		update.writeBudget = value;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothtick", value)) {
+		update.tickMs = value;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothspring", value)) {
+		update.springMs = value;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothfilter", value)) {
+		update.filterDelta = value;
+	}
+	if (AppleBacklightSmootherNS::getNumber(dictionary, "applbklsmoothhold", value)) {
+		update.filterHoldMs = value;
+	}
+
+	if (!AppleBacklightSmootherNS::workLoop) {
+		return kIOReturnNotReady;
+	}
+
+	// Rebuild the tables on the work loop, where they cannot change under a running timer tick.
+	result = AppleBacklightSmootherNS::workLoop->runAction([](OSObject *, void *update, void *, void *, void *) -> IOReturn {
+		return SmootherCore::applyConfiguration(*static_cast<SmootherConfiguration *>(update)) ? kIOReturnSuccess : kIOReturnBusy;
+	}, nullptr, &update);
+	if (result != kIOReturnSuccess) {
+		return result;
+	}
+
+	DBGLOG("smoother", "setProperties: curve %u parameter %u duration %u writes %u tick %u spring %u filter %u hold %u", static_cast<uint32_t>(update.curve), update.curveParameter, update.durationMs, update.writeBudget, update.tickMs, update.springMs, update.filterDelta, update.filterHoldMs);
+	return kIOReturnSuccess;
+}
+
+void AppleBacklightSmootherNS::publishState() {
+	// Called from the smoothing timer and the snapshot itself, both run on the work loop.
+	if (statisticsTimer && !statisticsPending) {
+		statisticsPending = true;
+		statisticsTimer->setTimeoutMS(STATISTICS_INTERVAL_MS);
+	}
+}
+
+OSArray *AppleBacklightSmootherNS::makeNumberArray(const uint32_t *values, size_t count) {
+	OSArray *array = OSArray::withCapacity(static_cast<unsigned>(count));
+	if (!array) {
+		return nullptr;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		OSNumber *number = OSNumber::withNumber(values[i], 32);
+		if (number) {
+			array->setObject(number);
+			number->release();
 		}
-#undef IMIN
-#undef IMAX
 	}
-	if (!AppleBacklightSmootherNS::backlightQueue.isEmpty()) {
-		AppleBacklightSmootherNS::smoothTimer->setTimeoutMS(AppleBacklightSmootherNS::DELAYMS);
+	return array;
+}
+
+void AppleBacklightSmootherNS::setNumber(OSDictionary *dictionary, const char *key, unsigned long long value, unsigned bits) {
+	OSNumber *number = OSNumber::withNumber(value, bits);
+	if (number) {
+		dictionary->setObject(key, number);
+		number->release();
+	}
+}
+
+bool AppleBacklightSmootherNS::getNumber(OSDictionary *dictionary, const char *key, uint32_t &value) {
+	OSNumber *number = OSDynamicCast(OSNumber, dictionary->getObject(key));
+	if (!number) {
+		return false;
+	}
+	value = number->unsigned32BitValue();
+	return true;
+}
+
+void AppleBacklightSmootherNS::setHistogram(OSDictionary *dictionary, const char *key, const uint32_t *buckets, size_t count) {
+	OSArray *array = makeNumberArray(buckets, count);
+	if (array) {
+		dictionary->setObject(key, array);
+		array->release();
 	}
-	IORecursiveLockUnlock(AppleBacklightSmootherNS::lockSmooth);
 }
 
 void AppleBacklightSmootherNS::init_plugin() {
 	workLoop = nullptr;
 	smoothTimer = nullptr;
-	lockSmooth = nullptr;
 	currentFramebuffer = nullptr;
 	currentFramebufferOpt = nullptr;
-	orgReadRegister32 = nullptr;
-	orgWriteRegister32 = nullptr;
-	backlightValueAssigned = false;
-	lastRequestedBacklightValue = 0;
-	currentBacklightValue = 0;
-	targetBacklightFrequency = 0;
-	targetPwmControl = 0;
-	driverBacklightFrequency = 0;
-	backlightDutyRegister = 0;
-	tableGenerated = false;
+	SmootherCore::reset();
+	SmootherCore::platform.currentTimeNs = currentTimeNs;
+	SmootherCore::platform.publishState = publishState;
+	statisticsTimer = nullptr;
+	statisticsPending = false;
+	publishedStatistics = {};
+	prepareTimer = nullptr;
+	sleepWakeNotifier = nullptr;
 
 #ifdef DEBUG
 	loggedFrequency = false;
@@ -165,10 +422,58 @@ void AppleBacklightSmootherNS::init_plugin() {
 			break;
 	}
 
+	SmootherCore::traceEnabled = checkKernelArgument("-applbklsmoothtrace");
+
+	uint32_t curve_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothcurve", &curve_boot_arg, sizeof(curve_boot_arg))) {
+		SmootherCore::configuration.curve = static_cast<SmootherCurve>(curve_boot_arg);
+	}
+
+	uint32_t curve_param_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothcurveparam", &curve_param_boot_arg, sizeof(curve_param_boot_arg))) {
+		SmootherCore::configuration.curveParameter = curve_param_boot_arg;
+	}
+
+	if (!SmootherCurves::isValid(SmootherCore::configuration.curve, SmootherCore::configuration.curveParameter)) {
+		SYSLOG("smoother", "curve %u does not take parameter %u, using the default curve", static_cast<uint32_t>(SmootherCore::configuration.curve), SmootherCore::configuration.curveParameter);
+		SmootherCore::configuration.curve = SmootherCurve::Quadratic;
+		SmootherCore::configuration.curveParameter = 0;
+	}
+
 	uint32_t pwmmax_boot_arg;
 	if (PE_parse_boot_argn("igfxpwmmax", &pwmmax_boot_arg, sizeof(pwmmax_boot_arg)) && pwmmax_boot_arg != 0) {
-		targetBacklightFrequency = pwmmax_boot_arg;
-		generateTables();
+		// Controllers pick this up in place of the firmware value when they are first seen.
+		SmootherCore::configuration.pwmMax = pwmmax_boot_arg;
+	}
+
+	uint32_t duration_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothdur", &duration_boot_arg, sizeof(duration_boot_arg))) {
+		SmootherCore::configuration.durationMs = duration_boot_arg;
+	}
+
+	uint32_t writes_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothwrites", &writes_boot_arg, sizeof(writes_boot_arg))) {
+		SmootherCore::configuration.writeBudget = writes_boot_arg;
+	}
+
+	uint32_t tick_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothtick", &tick_boot_arg, sizeof(tick_boot_arg)) && tick_boot_arg != 0) {
+		SmootherCore::configuration.tickMs = tick_boot_arg;
+	}
+
+	uint32_t spring_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothspring", &spring_boot_arg, sizeof(spring_boot_arg))) {
+		SmootherCore::configuration.springMs = spring_boot_arg;
+	}
+
+	uint32_t filter_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothfilter", &filter_boot_arg, sizeof(filter_boot_arg))) {
+		SmootherCore::configuration.filterDelta = filter_boot_arg;
+	}
+
+	uint32_t hold_boot_arg;
+	if (PE_parse_boot_argn("applbklsmoothhold", &hold_boot_arg, sizeof(hold_boot_arg))) {
+		SmootherCore::configuration.filterHoldMs = hold_boot_arg;
 	}
 
 	if (currentFramebuffer) {
@@ -192,7 +497,7 @@ void AppleBacklightSmootherNS::processKext(KernelPatcher &patcher, size_t index,
 		auto realFramebuffer = (currentFramebuffer && currentFramebuffer->loadIndex == index) ? currentFramebuffer : currentFramebufferOpt;
 
 		// Find original ReadRegister32
-		orgReadRegister32 = patcher.solveSymbol<decltype(orgReadRegister32)>(index, "__ZN31AppleIntelFramebufferController14ReadRegister32Em", address, size);
+		auto orgReadRegister32 = patcher.solveSymbol<uint32_t (*)(void *, uint32_t)>(index, "__ZN31AppleIntelFramebufferController14ReadRegister32Em", address, size);
 		if (!orgReadRegister32) {
 			SYSLOG("smoother", "Failed to find ReadRegister32");
 			patcher.clearError();
@@ -200,8 +505,8 @@ void AppleBacklightSmootherNS::processKext(KernelPatcher &patcher, size_t index,
 		}
 
 		// Find original WriteRegister32
-		orgWriteRegister32 = patcher.solveSymbol<decltype(orgWriteRegister32)>(index, "__ZN31AppleIntelFramebufferController15WriteRegister32Emj", address, size);
-		if (!orgReadRegister32) {
+		auto orgWriteRegister32 = patcher.solveSymbol<void (*)(void *, uint32_t, uint32_t)>(index, "__ZN31AppleIntelFramebufferController15WriteRegister32Emj", address, size);
+		if (!orgWriteRegister32) {
 			SYSLOG("smoother", "Failed to find WriteRegister32");
 			patcher.clearError();
 			return;
@@ -209,13 +514,11 @@ void AppleBacklightSmootherNS::processKext(KernelPatcher &patcher, size_t index,
 
 		// Determine which function to route to
 		auto cpuGeneration = BaseDeviceInfo::get().cpuGeneration;
-		decltype(wrapIvyWriteRegister32) *wrapWriteRegister32;
+		BacklightTranslator translator;
 		if (cpuGeneration <= CPUInfo::CpuGeneration::IvyBridge) {
-			wrapWriteRegister32 = wrapIvyWriteRegister32;
-			backlightDutyRegister = BLC_PWM_CPU_CTL;
+			translator = SmootherCore::makeTranslator<IvyBacklightTraits>();
 		} else if (cpuGeneration <= CPUInfo::CpuGeneration::KabyLake) {
-			wrapWriteRegister32 = wrapHswWriteRegister32;
-			backlightDutyRegister = BXT_BLC_PWM_FREQ1;
+			translator = SmootherCore::makeTranslator<HswBacklightTraits>();
 		} else {
 			// Lilu classifies Kaby Lake-R as Coffee Lake,
 			// we need to use CPU stepping to determine if it's Kaby Lake-R or Coffee Lake+
@@ -229,24 +532,24 @@ void AppleBacklightSmootherNS::processKext(KernelPatcher &patcher, size_t index,
 			uint32_t stepping = eax & 0xf;
 			if (cpuGeneration == CPUInfo::CpuGeneration::CoffeeLake && stepping == 0xa) { // Kaby Lake-R
 				if (realFramebuffer == &kextIntelCFLFb) {
-					wrapWriteRegister32 = wrapKblFakeWriteRegister32;
+					translator = SmootherCore::makeTranslator<KblFakeBacklightTraits>();
 				} else {
-					wrapWriteRegister32 = wrapHswWriteRegister32;
+					translator = SmootherCore::makeTranslator<HswBacklightTraits>();
 				}
-				backlightDutyRegister = BXT_BLC_PWM_FREQ1;
 			} else { // Coffee Lake+
 				if (realFramebuffer == &kextIntelCFLFb) {
-					wrapWriteRegister32 = wrapCflRealWriteRegister32;
+					translator = SmootherCore::makeTranslator<CflRealBacklightTraits>();
 				} else {
-					wrapWriteRegister32 = wrapCflFakeWriteRegister32;
+					translator = SmootherCore::makeTranslator<CflFakeBacklightTraits>();
 				}
-				backlightDutyRegister = BXT_BLC_PWM_DUTY1;
 			}
 		}
+		// Each framebuffer kext gets its own translator, so controllers keep the functions of the kext that drives them.
+		translator.accessors->readRegister32 = orgReadRegister32;
 
 		// Route WriteRegister32
 		patcher.eraseCoverageInstPrefix(reinterpret_cast<mach_vm_address_t>(orgWriteRegister32));
-		orgWriteRegister32 = reinterpret_cast<decltype(orgWriteRegister32)>(patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(orgWriteRegister32), reinterpret_cast<mach_vm_address_t>(wrapWriteRegister32), true));
+		orgWriteRegister32 = reinterpret_cast<decltype(orgWriteRegister32)>(patcher.routeFunction(reinterpret_cast<mach_vm_address_t>(orgWriteRegister32), reinterpret_cast<mach_vm_address_t>(translator.wrapWriteRegister32), true));
 
 		if (!orgWriteRegister32) {
 			SYSLOG("smoother", "Failed to route WriteRegister32");
@@ -254,384 +557,10 @@ void AppleBacklightSmootherNS::processKext(KernelPatcher &patcher, size_t index,
 			return;
 		}
 
-		DBGLOG("smoother", "Successfully routed hwSetBacklight");
-	}
-}
-
-void AppleBacklightSmootherNS::generateTables() {
-	// DUTY = a * STEP ^ 2 + START_VALUE
-	double a = static_cast<double>(targetBacklightFrequency - START_VALUE) / static_cast<double>(STEPS * STEPS);
-	for (int i = 0; i < STEPS; i++) {
-		dutyTables[i] = static_cast<uint32_t>(a * i * i + START_VALUE + 0.5f); // round to nearest integer
-	}
-	tableGenerated = true;
-}
+		translator.accessors->writeRegister32 = orgWriteRegister32;
 
-int AppleBacklightSmootherNS::lowerBound(uint32_t *data, int from, int to, int value) {
-	int result = to--, mid;
-	while (from <= to) {
-		mid = (from + to) >> 1;
-		if (data[mid] >= value) {
-			result = mid;
-			to = mid - 1;
-		} else {
-			from = mid + 1;
-		}
-	}
-	return result;
-}
-
-int AppleBacklightSmootherNS::upperBound(uint32_t *data, int from, int to, int value) {
-	int result = to--, mid;
-	while (from <= to) {
-		mid = (from + to) >> 1;
-		if (data[mid] > value) {
-			result = mid;
-			to = mid - 1;
-		} else {
-			from = mid + 1;
-		}
+		DBGLOG("smoother", "Successfully routed hwSetBacklight, duty register 0x%x", translator.dutyRegister);
 	}
-	return result;
-}
-
-void AppleBacklightSmootherNS::pushQueue(void *that, uint32_t value, uint32_t mask) {
-#ifdef DEBUG
-	if (!loggedFrequency && ADDPR(selfInstance)) {
-		loggedFrequency = true;
-		ADDPR(selfInstance)->setProperty("Target Backlight Frequency", OSNumber::withNumber(targetBacklightFrequency, 32));
-		ADDPR(selfInstance)->setProperty("Target PWM Control", OSNumber::withNumber(targetPwmControl, 32));
-		ADDPR(selfInstance)->setProperty("Driver Backlight Frequency", OSNumber::withNumber(driverBacklightFrequency, 32));
-
-		OSArray *dutyTablesArray = OSArray::withCapacity(STEPS);
-		for (int i = 0; i < STEPS; i++) {
-			dutyTablesArray->setObject(OSNumber::withNumber(dutyTables[i], 32));
-		}
-		ADDPR(selfInstance)->setProperty("Duty Tables", dutyTablesArray);
-	}
-#endif
-
-	if (lastRequestedBacklightValue == value) {
-		return;
-	}
-
-	if (!tableGenerated) {
-		orgWriteRegister32(that, backlightDutyRegister, mask | value);
-		currentBacklightValue = value;
-		return;
-	}
-
-	IORecursiveLockLock(lockSmooth);
-	bool isQueueEmpty = backlightQueue.isEmpty();
-
-	if (lastRequestedBacklightValue < value) {
-		int from = upperBound(dutyTables, 0, STEPS, lastRequestedBacklightValue);
-		int to = lowerBound(dutyTables, 0, STEPS, value) - 1;
-
-		if (from < STEPS && to < STEPS) {
-			for (int i = from; i <= to; i++) {
-				backlightQueue.push(SimpleTriple<void *, uint32_t, uint32_t>(that, mask | dutyTables[i], dutyTables[i]));
-			}
-		}
-
-		backlightQueue.push(SimpleTriple<void *, uint32_t, uint32_t>(that, mask | value, value));
-	} else { // lastRequestedBacklightValue > value
-		int from = lowerBound(dutyTables, 0, STEPS, lastRequestedBacklightValue) - 1;
-		int to = upperBound(dutyTables, 0, STEPS, value);
-
-		if (from < STEPS && to < STEPS) {
-			for (int i = from; i >= to; i--) {
-				backlightQueue.push(SimpleTriple<void *, uint32_t, uint32_t>(that, mask | dutyTables[i], dutyTables[i]));
-			}
-		}
-
-		backlightQueue.push(SimpleTriple<void *, uint32_t, uint32_t>(that, mask | value, value));
-	}
-
-	lastRequestedBacklightValue = value;
-#ifdef DEBUG
-	if (ADDPR(selfInstance)) {
-		ADDPR(selfInstance)->setProperty("Last Requested Backlight Value", lastRequestedBacklightValue);
-	}
-#endif
-
-	if (isQueueEmpty) {
-		smoothTimer->setTimeoutMS(DELAYMS);
-	}
-
-	IORecursiveLockUnlock(lockSmooth);
-}
-
-void AppleBacklightSmootherNS::wrapIvyWriteRegister32(void *that, uint32_t reg, uint32_t value) {
-	if (reg == BXT_BLC_PWM_FREQ1) {
-		if (value && value != driverBacklightFrequency) {
-			DBGLOG("smoother", "wrapIvyWriteRegister32: driver requested BXT_BLC_PWM_FREQ1 = 0x%x", value);
-			driverBacklightFrequency = value;
-		}
-
-		if (targetBacklightFrequency == 0) {
-			// Save the hardware PWM frequency as initially set up by the system firmware.
-			// We'll need this to restore later after system sleep.
-			targetBacklightFrequency = orgReadRegister32(that, BXT_BLC_PWM_FREQ1);
-			DBGLOG("smoother", "wrapIvyWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 = 0x%x", targetBacklightFrequency);
-
-			if (targetBacklightFrequency == 0) {
-				// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
-				targetBacklightFrequency = FallbackTargetBacklightFrequency;
-				SYSLOG("smoother", "wrapIvyWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 is ZERO");
-			}
-
-			generateTables();
-		}
-
-		if (value) {
-			// Nonzero writes to this register need to use the original system value.
-			// Yet the driver can safely write zero to this register as part of system sleep.
-			value = targetBacklightFrequency;
-		}
-	} else if (reg == BLC_PWM_CPU_CTL) {
-		if (driverBacklightFrequency && targetBacklightFrequency) {
-			// Translate the PWM duty cycle between the driver scale value and the HW scale value
-			uint32_t rescaledValue = static_cast<uint32_t>((static_cast<uint64_t>(value) * static_cast<uint64_t>(targetBacklightFrequency)) / static_cast<uint64_t>(driverBacklightFrequency));
-			DBGLOG("smoother", "wrapIvyWriteRegister32: write BLC_PWM_CPU_CTL 0x%x/0x%x, rescaled to 0x%x/0x%x", value, driverBacklightFrequency, rescaledValue, targetBacklightFrequency);
-
-			if (lockSmooth && backlightValueAssigned) {
-				pushQueue(that, rescaledValue);
-				return;
-			}
-
-			value = rescaledValue;
-			backlightValueAssigned = true;
-			lastRequestedBacklightValue = currentBacklightValue = rescaledValue;
-		} else {
-			// This should never happen, but in case it does we should log it at the very least.
-			SYSLOG("smoother", "wrapIvyWriteRegister32: write BLC_PWM_CPU_CTL has zero frequency driver (%d) target (%d)", driverBacklightFrequency, targetBacklightFrequency);
-		}
-	}
-
-	orgWriteRegister32(that, reg, value);
-}
-
-void AppleBacklightSmootherNS::wrapHswWriteRegister32(void *that, uint32_t reg, uint32_t value) {
-	if (reg == BXT_BLC_PWM_FREQ1) {
-		// BXT_BLC_PWM_FREQ1 controls the backlight intensity.
-		// High 16 of this register are the denominator (frequency), low 16 are the numerator (duty cycle).
-
-		if (targetBacklightFrequency == 0) {
-			// Populate the hardware PWM frequency as initially set up by the system firmware.
-			uint32_t org_value = orgReadRegister32(that, BXT_BLC_PWM_FREQ1);
-			targetBacklightFrequency = (org_value & 0xffff0000U) >> 16U;
-			DBGLOG("smoother", "wrapHswWriteRegister32: system initialized PWM frequency = 0x%x", targetBacklightFrequency);
-
-			if (targetBacklightFrequency == 0) {
-				// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
-				targetBacklightFrequency = FallbackTargetBacklightFrequency;
-				SYSLOG("smoother", "wrapHswWriteRegister32: system initialized PWM frequency is ZERO");
-			}
-
-			generateTables();
-		}
-
-		uint32_t dutyCycle = value & 0xffffU;
-		uint32_t frequency = (value & 0xffff0000U) >> 16U;
-
-		if (frequency && frequency != driverBacklightFrequency) {
-			DBGLOG("smoother", "wrapHswWriteRegister32: driver requested max frequency = 0x%x", frequency);
-			driverBacklightFrequency = frequency;
-		}
-
-		uint32_t rescaledValue = frequency == 0 ? 0 : static_cast<uint32_t>((static_cast<uint64_t>(dutyCycle) * static_cast<uint64_t>(targetBacklightFrequency)) / static_cast<uint64_t>(frequency));
-		DBGLOG("smoother", "wrapHswWriteRegister32: write BXT_BLC_PWM_FREQ1 0x%x/0x%x, rescaled to 0x%x/0x%x", dutyCycle, driverBacklightFrequency, rescaledValue, targetBacklightFrequency);
-
-		if (frequency) {
-			// Nonzero writes to frequency need to use the original system frequency.
-			// Yet the driver can safely write zero to this register as part of system sleep.
-			frequency = targetBacklightFrequency;
-		}
-
-		if (lockSmooth && backlightValueAssigned) {
-			pushQueue(that, rescaledValue, (frequency << 16U));
-			return;
-		}
-
-		// Write the rescaled duty cycle and frequency
-		value = (frequency << 16U) | rescaledValue;
-		backlightValueAssigned = true;
-		lastRequestedBacklightValue = currentBacklightValue = rescaledValue;
-	}
-
-	orgWriteRegister32(that, reg, value);
-}
-
-void AppleBacklightSmootherNS::wrapKblFakeWriteRegister32(void *that, uint32_t reg, uint32_t value) {
-	if (reg == BXT_BLC_PWM_FREQ1) {
-		uint32_t frequency = value;
-
-		if (frequency && frequency != driverBacklightFrequency) {
-			DBGLOG("smoother", "wrapKblFakeWriteRegister32: driver requested BXT_BLC_PWM_FREQ1 = 0x%x", value);
-			driverBacklightFrequency = frequency;
-		}
-
-		if (targetBacklightFrequency == 0) {
-			// Save the hardware PWM frequency as initially set up by the system firmware.
-			// We'll need this to restore later after system sleep.
-			targetBacklightFrequency = (orgReadRegister32(that, BXT_BLC_PWM_FREQ1) & 0xffff0000U) >> 16U;
-			DBGLOG("smoother", "wrapKblFakeWriteRegister32: system initialized PWM MAX = 0x%x", targetBacklightFrequency);
-
-			if (targetBacklightFrequency == 0) {
-				// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
-				targetBacklightFrequency = FallbackTargetBacklightFrequency;
-				SYSLOG("smoother", "wrapKblFakeWriteRegister32: system initialized PWM MAX is ZERO");
-			}
-
-			generateTables();
-		}
-
-		if (frequency) {
-			// Nonzero writes to PWM frequency need to use the original system value.
-			// Yet the driver can safely write zero as part of system sleep.
-			frequency = targetBacklightFrequency;
-		}
-
-		// Read current duty cycle
-		uint32_t dutyCycle = orgReadRegister32(that, BXT_BLC_PWM_FREQ1) & 0xffffU;
-
-		value = (frequency << 16U) | dutyCycle;
-	} else if (reg == BXT_BLC_PWM_DUTY1) {
-		if (driverBacklightFrequency && targetBacklightFrequency) {
-			// Translate the PWM duty cycle between the driver scale value and the HW scale value
-			uint32_t rescaledValue = static_cast<uint32_t>((static_cast<uint64_t>(value) * static_cast<uint64_t>(targetBacklightFrequency)) / static_cast<uint64_t>(driverBacklightFrequency));
-			DBGLOG("smoother", "wrapKblFakeWriteRegister32: write PWM_DUTY1 0x%x/0x%x, rescaled to 0x%x/0x%x", value, driverBacklightFrequency, rescaledValue, targetBacklightFrequency);
-
-			// Read current frequency
-			uint32_t frequency = (orgReadRegister32(that, BXT_BLC_PWM_FREQ1) & 0xffff0000U) >> 16U;
-
-			if (lockSmooth && backlightValueAssigned) {
-				pushQueue(that, rescaledValue, (frequency << 16U));
-				return;
-			}
-
-			reg = BXT_BLC_PWM_FREQ1;
-			value = (frequency << 16U) | rescaledValue;
-			backlightValueAssigned = true;
-			lastRequestedBacklightValue = currentBacklightValue = rescaledValue;
-		} else {
-			// This should never happen, but in case it does we should log it at the very least.
-			SYSLOG("smoother", "wrapKblFakeWriteRegister32: write PWM_DUTY1 has zero frequency driver (%d) target (%d)", driverBacklightFrequency, targetBacklightFrequency);
-		}
-	}
-
-	orgWriteRegister32(that, reg, value);
-}
-
-void AppleBacklightSmootherNS::wrapCflRealWriteRegister32(void *that, uint32_t reg, uint32_t value) {
-	if (reg == BXT_BLC_PWM_FREQ1) {
-		if (value && value != driverBacklightFrequency) {
-			DBGLOG("smoother", "wrapCflRealWriteRegister32: driver requested BXT_BLC_PWM_FREQ1 = 0x%x", value);
-			driverBacklightFrequency = value;
-		}
-
-		if (targetBacklightFrequency == 0) {
-			// Save the hardware PWM frequency as initially set up by the system firmware.
-			// We'll need this to restore later after system sleep.
-			targetBacklightFrequency = orgReadRegister32(that, BXT_BLC_PWM_FREQ1);
-			DBGLOG("smoother", "wrapCflRealWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 = 0x%x", targetBacklightFrequency);
-
-			if (targetBacklightFrequency == 0) {
-				// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
-				targetBacklightFrequency = FallbackTargetBacklightFrequency;
-				SYSLOG("smoother", "wrapCflRealWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 is ZERO");
-			}
-
-			generateTables();
-		}
-
-		if (value) {
-			// Nonzero writes to this register need to use the original system value.
-			// Yet the driver can safely write zero to this register as part of system sleep.
-			value = targetBacklightFrequency;
-		}
-	} else if (reg == BXT_BLC_PWM_DUTY1) {
-		if (driverBacklightFrequency && targetBacklightFrequency) {
-			// Translate the PWM duty cycle between the driver scale value and the HW scale value
-			uint32_t rescaledValue = static_cast<uint32_t>((static_cast<uint64_t>(value) * static_cast<uint64_t>(targetBacklightFrequency)) / static_cast<uint64_t>(driverBacklightFrequency));
-			DBGLOG("smoother", "wrapCflRealWriteRegister32: write PWM_DUTY1 0x%x/0x%x, rescaled to 0x%x/0x%x", value, driverBacklightFrequency, rescaledValue, targetBacklightFrequency);
-
-			if (lockSmooth && backlightValueAssigned) {
-				pushQueue(that, rescaledValue);
-				return;
-			}
-
-			value = rescaledValue;
-			backlightValueAssigned = true;
-			lastRequestedBacklightValue = currentBacklightValue = rescaledValue;
-		} else {
-			// This should never happen, but in case it does we should log it at the very least.
-			SYSLOG("smoother", "wrapCflRealWriteRegister32: write PWM_DUTY1 has zero frequency driver (%d) target (%d)", driverBacklightFrequency, targetBacklightFrequency);
-		}
-	}
-
-	orgWriteRegister32(that, reg, value);
-}
-
-void AppleBacklightSmootherNS::wrapCflFakeWriteRegister32(void *that, uint32_t reg, uint32_t value) {
-	if (reg == BXT_BLC_PWM_FREQ1) { // aka BLC_PWM_PCH_CTL2
-		if (targetBacklightFrequency == 0) {
-			// Populate the hardware PWM frequency as initially set up by the system firmware.
-			targetBacklightFrequency = orgReadRegister32(that, BXT_BLC_PWM_FREQ1);
-			DBGLOG("smoother", "wrapCflFakeWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 = 0x%x", targetBacklightFrequency);
-			DBGLOG("smoother", "wrapCflFakeWriteRegister32: system initialized BXT_BLC_PWM_CTL1 = 0x%x", orgReadRegister32(that, BXT_BLC_PWM_CTL1));
-
-			if (targetBacklightFrequency == 0) {
-				// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
-				targetBacklightFrequency = FallbackTargetBacklightFrequency;
-				SYSLOG("smoother", "wrapCflFakeWriteRegister32: system initialized BXT_BLC_PWM_FREQ1 is ZERO");
-			}
-
-			generateTables();
-		}
-
-		// For the KBL driver, 0xc8254 (BLC_PWM_PCH_CTL2) controls the backlight intensity.
-		// High 16 of this write are the denominator (frequency), low 16 are the numerator (duty cycle).
-		// Translate this into a write to c8258 (BXT_BLC_PWM_DUTY1) for the CFL hardware, scaled by the system-provided value in c8254 (BXT_BLC_PWM_FREQ1).
-		uint16_t frequency = (value & 0xffff0000U) >> 16U;
-		uint16_t dutyCycle = value & 0xffffU;
-
-		uint32_t rescaledValue = frequency == 0 ? 0 : static_cast<uint32_t>((static_cast<uint64_t>(dutyCycle) * static_cast<uint64_t>(targetBacklightFrequency)) / static_cast<uint64_t>(frequency));
-		DBGLOG("smoother", "wrapCflFakeWriteRegister32: write PWM_DUTY1 0x%x/0x%x, rescaled to 0x%x/0x%x", dutyCycle, frequency, rescaledValue, targetBacklightFrequency);
-
-		// Reset the hardware PWM frequency. Write the original system value if the driver-requested value is nonzero. If the driver requests
-		// zero, we allow that, since it's trying to turn off the backlight PWM for sleep.
-		orgWriteRegister32(that, BXT_BLC_PWM_FREQ1, frequency ? targetBacklightFrequency : 0);
-
-		if (lockSmooth && backlightValueAssigned) {
-			pushQueue(that, rescaledValue);
-			return;
-		}
-
-		// Finish by writing the duty cycle.
-		reg = BXT_BLC_PWM_DUTY1;
-		value = rescaledValue;
-		backlightValueAssigned = true;
-		lastRequestedBacklightValue = currentBacklightValue = rescaledValue;
-	} else if (reg == BXT_BLC_PWM_CTL1) {
-		if (targetPwmControl == 0) {
-			// Save the original hardware PWM control value
-			targetPwmControl = orgReadRegister32(that, BXT_BLC_PWM_CTL1);
-		}
-
-		DBGLOG("smoother", "wrapCflFakeWriteRegister32: write BXT_BLC_PWM_CTL1 0x%x, previous was 0x%x", value, orgReadRegister32(that, BXT_BLC_PWM_CTL1));
-
-		if (value) {
-			// Set the PWM frequency before turning it on to avoid the 3 minute blackout bug
-			orgWriteRegister32(that, BXT_BLC_PWM_FREQ1, targetBacklightFrequency);
-
-			// Use the original hardware PWM control value.
-			value = targetPwmControl;
-		}
-	}
-
-	orgWriteRegister32(that, reg, value);
 }
 
 static const char *bootargOff[] {
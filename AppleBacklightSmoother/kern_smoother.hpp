@@ -32,95 +32,39 @@ static KernelPatcher::KextInfo kextIntelCNLFb   { "com.apple.driver.AppleIntelCN
 static KernelPatcher::KextInfo kextIntelICLLPFb { "com.apple.driver.AppleIntelICLLPGraphicsFramebuffer", pathIntelICLLPFb, arrsize(pathIntelICLLPFb), {}, {}, KernelPatcher::KextInfo::Unloaded };
 static KernelPatcher::KextInfo kextIntelICLHPFb { "com.apple.driver.AppleIntelICLHPGraphicsFramebuffer", pathIntelICLHPFb, arrsize(pathIntelICLHPFb), {}, {}, KernelPatcher::KextInfo::Unloaded };
 
-static constexpr uint32_t BLC_PWM_CPU_CTL = 0x48254;
-static constexpr uint32_t BXT_BLC_PWM_CTL1 = 0xC8250;
-static constexpr uint32_t BXT_BLC_PWM_FREQ1 = 0xC8254;
-static constexpr uint32_t BXT_BLC_PWM_DUTY1 = 0xC8258;
-
-template <typename X, typename Y, typename Z>
-struct SimpleTriple {
-	X first;
-	Y second;
-	Z third;
-
-	inline SimpleTriple() {}
-	inline SimpleTriple(const X &first, const Y &second, const Z &third): first(first), second(second), third(third) {}
-};
-
-template <class T, unsigned N>
-class SimpleQueue {
-private:
-	T m_buffer[N];
-	unsigned m_head, m_tail;
-
-public:
-	inline SimpleQueue() { reset(); }
-	inline void reset() {
-		m_head = 0;
-		m_tail = 0;
-	}
-	inline unsigned count() {
-		return (m_head >= m_tail) ? (m_head - m_tail) : (N - m_tail + m_head);
-	}
-	inline bool isEmpty() {
-		return (m_head == m_tail);
-	}
-	void push(const T &data) {
-		unsigned new_head = m_head + 1;
-		if (new_head >= N) new_head = 0;
-		if (new_head != m_tail) {
-			m_buffer[m_head] = data;
-			m_head = new_head;
-		}
-	}
-	T fetch() {
-		T result = m_buffer[m_tail++];
-		if (m_tail >= N) m_tail = 0;
-		return result;
-	}
-};
-
 namespace AppleBacklightSmootherNS {
 	static IOWorkLoop *workLoop;
 	static IOTimerEventSource *smoothTimer;
-	static IORecursiveLock *lockSmooth;
 
-	static KernelPatcher::KextInfo *currentFramebuffer;
-	static KernelPatcher::KextInfo *currentFramebufferOpt;
+	// Statistics are published at most once per interval while the timer ticks or the counters keep changing.
+	static constexpr uint32_t STATISTICS_INTERVAL_MS = 1000;
+	static IOTimerEventSource *statisticsTimer;
+	static bool statisticsPending;
+	static SmootherStatistics publishedStatistics;
 
-	static uint32_t (*orgReadRegister32)(void *, uint32_t);
-	static void (*orgWriteRegister32)(void *, uint32_t, uint32_t);
+	// Captures firmware PWM values and builds duty tables for newly seen controllers.
+	static IOTimerEventSource *prepareTimer;
 
-	static constexpr uint32_t FallbackTargetBacklightFrequency {120000};
+	// Cancels transitions at sleep and restores the brightness at wake.
+	static IONotifier *sleepWakeNotifier;
+	static IOReturn sleepWakeHandler(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize);
 
-	static bool backlightValueAssigned;
-	static uint32_t lastRequestedBacklightValue;
-	static uint32_t currentBacklightValue;
-	static uint32_t targetBacklightFrequency;
-	static uint32_t targetPwmControl;
-	static uint32_t driverBacklightFrequency;
-	static uint32_t backlightDutyRegister;
-	static SimpleQueue<SimpleTriple<void *, uint32_t, uint32_t>, 2048> backlightQueue;
+	static KernelPatcher::KextInfo *currentFramebuffer;
+	static KernelPatcher::KextInfo *currentFramebufferOpt;
 
 	static void init_plugin();
 
 	static void processKext(KernelPatcher &patcher, size_t index, mach_vm_address_t address, size_t size);
 
-	static constexpr uint32_t START_VALUE = 5;
-	static constexpr uint32_t STEPS = 256;
-	static constexpr uint32_t DELAYMS = 7;
-	static uint32_t dutyTables[STEPS];
-	static bool tableGenerated;
-	static void generateTables();
-	inline static int lowerBound(uint32_t *data, int from, int to, int value);
-	inline static int upperBound(uint32_t *data, int from, int to, int value);
-	static void pushQueue(void *that, uint32_t value, uint32_t mask = 0);
-
-	static void wrapIvyWriteRegister32(void *that, uint32_t reg, uint32_t value);
-	static void wrapHswWriteRegister32(void *that, uint32_t reg, uint32_t value);
-	static void wrapKblFakeWriteRegister32(void *that, uint32_t reg, uint32_t value);
-	static void wrapCflRealWriteRegister32(void *that, uint32_t reg, uint32_t value);
-	static void wrapCflFakeWriteRegister32(void *that, uint32_t reg, uint32_t value);
+	static void scheduleSmoothTimer(uint32_t us);
+	static void schedulePrepare();
+	static uint64_t currentTimeNs();
+
+	static void publishState();
+	static OSArray *makeNumberArray(const uint32_t *values, size_t count);
+	static void setNumber(OSDictionary *dictionary, const char *key, unsigned long long value, unsigned bits);
+	static bool getNumber(OSDictionary *dictionary, const char *key, uint32_t &value);
+	static void setHistogram(OSDictionary *dictionary, const char *key, const uint32_t *buckets, size_t count);
 
 #ifdef DEBUG
 	static bool loggedFrequency;
@@ -133,7 +77,10 @@ public:
 	IOService *probe(IOService *provider, SInt32 *score) override;
 	bool start(IOService *provider) override;
 	void stop(IOService *provider) override;
+	IOReturn setProperties(OSObject *properties) override;
 	void dischargeQueue();
+	void prepareControllers();
+	void publishStatistics();
 };
 
 extern PRODUCT_NAME *ADDPR(selfInstance);
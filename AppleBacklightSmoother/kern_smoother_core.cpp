@@ -0,0 +1,1149 @@
+//
+//  kern_smoother_core.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "kern_smoother_core.hpp"
+#include "kern_smoother_curves.hpp"
+
+namespace SmootherCore {
+	SmootherPlatform platform;
+	SmootherConfiguration configuration {0, SmootherCurve::Quadratic, 0, DEFAULT_WRITE_BUDGET, 0, DELAYMS, 0, 0, 0};
+
+	BacklightController controllers[MAX_CONTROLLERS];
+
+	static constexpr DutyTable makeDutyTable(uint32_t frequency) {
+		DutyTable table {frequency, {}};
+		for (uint32_t i = 0; i < STEPS; i++) {
+			table.values[i] = quadraticDuty(frequency, i);
+		}
+		return table;
+	}
+
+	// Tables for the firmware fallback and common igfxpwmmax values, built at compile time.
+	static constexpr DutyTable prebuiltDutyTables[] {
+		makeDutyTable(FallbackTargetBacklightFrequency),
+		makeDutyTable(0x56C),
+		makeDutyTable(0x710),
+		makeDutyTable(0x7A1),
+		makeDutyTable(0xAD9),
+		makeDutyTable(0xFFFF),
+	};
+
+	SmootherStatistics statistics;
+
+	// Registers kept in BacklightController::shadowRegisters, in this order.
+	// Only values the plugin wrote itself are trusted to skip writes, read values may be stale firmware state.
+	static constexpr uint64_t ShadowValid = 1ULL << 32U;
+	static constexpr uint64_t ShadowWritten = 1ULL << 33U;
+	static constexpr uint32_t shadowRegisterList[SHADOW_REGISTERS] {BLC_PWM_CPU_CTL, BXT_BLC_PWM_CTL1, BXT_BLC_PWM_FREQ1, BXT_BLC_PWM_DUTY1};
+
+	static uint64_t *shadowRegister(BacklightController &controller, uint32_t reg) {
+		if (__atomic_load_n(&controller.shadowSuspended, __ATOMIC_ACQUIRE)) {
+			return nullptr;
+		}
+
+		for (size_t i = 0; i < arrsize(shadowRegisterList); i++) {
+			if (shadowRegisterList[i] == reg) {
+				return &controller.shadowRegisters[i];
+			}
+		}
+		return nullptr;
+	}
+
+	bool traceEnabled;
+
+	// Register trace, writers claim slots with an atomic increment and overwrite the oldest entries.
+	static SmootherTraceRecord traceRing[TRACE_RECORDS];
+	static uint32_t traceHead;
+
+	// Set while the smoothing timer is armed or running, one timer serves every controller.
+	static bool timerArmed;
+	static uint64_t timerDeadline;
+
+	// Set while applyConfiguration rebuilds tables.
+	static bool configurationUpdating;
+
+	// Set between the sleep and wake notifications, wakeTime is when the system started powering on.
+	static bool systemSleeping;
+	static uint64_t wakeTime;
+
+	// Set once a controller found every slot taken.
+	static bool controllersExhausted;
+
+	// Time from since to now in us, zero when since was stamped on another thread after now was read.
+	static uint64_t microsecondsSince(uint64_t since, uint64_t now) {
+		return now > since ? (now - since) / 1000 : 0;
+	}
+}
+
+void SmootherCore::reset() {
+	for (auto &controller : controllers) {
+		controller.that = nullptr;
+		controller.claimed = false;
+	}
+	controllersExhausted = false;
+	traceHead = 0;
+	timerArmed = false;
+	timerDeadline = 0;
+	configurationUpdating = false;
+	systemSleeping = false;
+	wakeTime = 0;
+	statistics = {};
+}
+
+SmootherCore::BacklightController *SmootherCore::controllerFor(void *that, uint32_t dutyRegister, const BacklightAccessors *accessors) {
+	for (auto &controller : controllers) {
+		void *owner = __atomic_load_n(&controller.that, __ATOMIC_ACQUIRE);
+		if (owner == nullptr) {
+			// Claim the slot first, only the winner initialises it and publishes its controller.
+			bool claimed = false;
+			if (__atomic_compare_exchange_n(&controller.claimed, &claimed, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				controller.dutyRegister = dutyRegister;
+				controller.accessors = accessors;
+				controller.backlightValueAssigned = false;
+				controller.lastRequestedBacklightValue = 0;
+				controller.currentBacklightValue = 0;
+				controller.targetBacklightFrequency = configuration.pwmMax;
+				controller.targetPwmControl = 0;
+				controller.driverBacklightFrequency = 0;
+				controller.dutyTable = nullptr;
+				// Generation 0 is never current, so every cached plan starts out invalid.
+				controller.tableGeneration = 0;
+				for (auto &plan : controller.planCache) {
+					plan.generation = 0;
+				}
+				controller.dutyReciprocal = {};
+				for (auto &shadow : controller.shadowRegisters) {
+					shadow = 0;
+				}
+				controller.shadowSuspended = false;
+				controller.requestQueue.reset();
+				controller.latestRequest = 0;
+				controller.requestDropped = false;
+				controller.transitionActive = false;
+				controller.transitionGeneration = 0;
+				controller.hardwarePacked = false;
+				controller.prepareRequested = false;
+				controller.deferredTranslator = nullptr;
+				for (auto &deferred : controller.deferredWrites) {
+					deferred = 0;
+				}
+				controller.restorePending = false;
+				controller.forwardedValue = 0;
+				controller.forwardTime = 0;
+				controller.requestHeld = false;
+
+				__atomic_store_n(&controller.that, that, __ATOMIC_RELEASE);
+				DBGLOG("smoother", "controllerFor: tracking controller %p", that);
+				return &controller;
+			}
+
+			// Another thread is initialising the slot, maybe for this very controller. Pass this write
+			// through instead of waiting, the driver's next write finds the slot published.
+			owner = __atomic_load_n(&controller.that, __ATOMIC_ACQUIRE);
+			if (owner == nullptr) {
+				return nullptr;
+			}
+		}
+
+		if (owner == that) {
+			if (accessors && !__atomic_load_n(&controller.accessors, __ATOMIC_ACQUIRE)) {
+				// Claimed by a lookup before any translator saw the controller.
+				controller.dutyRegister = dutyRegister;
+				__atomic_store_n(&controller.accessors, accessors, __ATOMIC_RELEASE);
+			}
+			return &controller;
+		}
+	}
+
+	if (!__atomic_exchange_n(&controllersExhausted, true, __ATOMIC_RELAXED)) {
+		SYSLOG("smoother", "controllerFor: too many controllers, writes for %p are passed through", that);
+	}
+	return nullptr;
+}
+
+void SmootherCore::generateTables(BacklightController &controller) {
+	uint32_t frequency = controller.targetBacklightFrequency;
+	if (configuration.curve == SmootherCurve::Quadratic) {
+		for (auto &table : prebuiltDutyTables) {
+			if (table.quadraticFrequency == frequency) {
+				__atomic_store_n(&controller.dutyTable, &table, __ATOMIC_RELEASE);
+				__atomic_fetch_add(&controller.tableGeneration, 1, __ATOMIC_ACQ_REL);
+				return;
+			}
+		}
+	}
+
+	// Fill the buffer the timer is not reading.
+	auto current = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+	auto table = current == &controller.generatedTables[0] ? &controller.generatedTables[1] : &controller.generatedTables[0];
+	if (configuration.curve == SmootherCurve::Quadratic) {
+		table->quadraticFrequency = frequency > START_VALUE ? frequency : 0;
+		for (uint32_t i = 0; i < STEPS; i++) {
+			table->values[i] = quadraticDuty(frequency, i);
+		}
+	} else {
+		table->quadraticFrequency = 0;
+		SmootherCurves::fillTable(table->values, STEPS, frequency, configuration.curve, configuration.curveParameter);
+	}
+
+	__atomic_store_n(&controller.dutyTable, table, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&controller.tableGeneration, 1, __ATOMIC_ACQ_REL);
+}
+
+bool SmootherCore::applyConfiguration(const SmootherConfiguration &update) {
+	if (__atomic_exchange_n(&configurationUpdating, true, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+
+	bool curveChanged = update.curve != configuration.curve || update.curveParameter != configuration.curveParameter;
+
+	// The timer reads each field on its own, so they are stored one by one.
+	__atomic_store_n(&configuration.durationMs, update.durationMs, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.curve, update.curve, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.curveParameter, update.curveParameter, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.writeBudget, update.writeBudget, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.tickMs, update.tickMs ? update.tickMs : DELAYMS, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.springMs, update.springMs, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.filterDelta, update.filterDelta, __ATOMIC_RELAXED);
+	__atomic_store_n(&configuration.filterHoldMs, update.filterHoldMs, __ATOMIC_RELAXED);
+
+	if (curveChanged) {
+		for (auto &controller : controllers) {
+			if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE) && __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE)) {
+				generateTables(controller);
+			}
+		}
+	}
+
+	__atomic_store_n(&configurationUpdating, false, __ATOMIC_RELEASE);
+	return true;
+}
+
+int SmootherCore::lowerBound(const uint32_t *data, int from, int to, uint32_t value) {
+	int count = to - from;
+	if (count <= 0) {
+		return to;
+	}
+	const uint32_t *base = data + from;
+	while (count > 1) {
+		int half = count >> 1;
+		base = base[half - 1] < value ? base + half : base;
+		count -= half;
+	}
+	return static_cast<int>(base - data) + (*base < value);
+}
+
+int SmootherCore::upperBound(const uint32_t *data, int from, int to, uint32_t value) {
+	int count = to - from;
+	if (count <= 0) {
+		return to;
+	}
+	const uint32_t *base = data + from;
+	while (count > 1) {
+		int half = count >> 1;
+		base = base[half - 1] <= value ? base + half : base;
+		count -= half;
+	}
+	return static_cast<int>(base - data) + (*base <= value);
+}
+
+int SmootherCore::dutyLowerBound(const DutyTable &table, uint32_t value) {
+	return lowerBound(table.values, 0, STEPS, value);
+}
+
+int SmootherCore::dutyUpperBound(const DutyTable &table, uint32_t value) {
+	return upperBound(table.values, 0, STEPS, value);
+}
+
+SmootherReciprocal SmootherCore::makeReciprocal(uint32_t target, uint32_t divisor) {
+	SmootherReciprocal reciprocal {target, divisor, 0, 0};
+	uint32_t targetBits = target ? 32 - __builtin_clz(target) : 0;
+	uint32_t divisorBits = divisor > 1 ? 32 - __builtin_clz(divisor - 1) : 0;
+
+	// With shift = 16 + ceil(log2(divisor)) the rounding error of the multiplier stays below 1 / divisor for 16-bit values.
+	// The multiplier must fit into 64 bits before the division and value * multiplier afterwards.
+	if (divisor && targetBits <= 31 && targetBits + divisorBits <= 47) {
+		reciprocal.shift = 16 + divisorBits;
+		reciprocal.multiplier = ((static_cast<uint64_t>(target) << reciprocal.shift) + divisor - 1) / divisor;
+	}
+	return reciprocal;
+}
+
+uint32_t SmootherCore::rescaleDuty(BacklightController &controller, uint32_t value, uint32_t divisor) {
+	auto &reciprocal = controller.dutyReciprocal;
+	if (reciprocal.divisor != divisor || reciprocal.target != controller.targetBacklightFrequency) {
+		reciprocal = makeReciprocal(controller.targetBacklightFrequency, divisor);
+	}
+
+	if (reciprocal.shift && value <= 0xffffU) {
+		return static_cast<uint32_t>((value * reciprocal.multiplier) >> reciprocal.shift);
+	}
+	return static_cast<uint32_t>((static_cast<uint64_t>(value) * static_cast<uint64_t>(controller.targetBacklightFrequency)) / static_cast<uint64_t>(divisor));
+}
+
+uint32_t SmootherCore::readRegister32(BacklightController &controller, uint32_t reg) {
+	auto shadow = shadowRegister(controller, reg);
+	if (shadow) {
+		uint64_t cached = __atomic_load_n(shadow, __ATOMIC_RELAXED);
+		if (cached & ShadowValid) {
+			return static_cast<uint32_t>(cached);
+		}
+	}
+
+	uint32_t value = controller.accessors->readRegister32(controller.that, reg);
+	if (shadow) {
+		__atomic_store_n(shadow, ShadowValid | value, __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
+void SmootherCore::writeRegister32(BacklightController &controller, uint32_t reg, uint32_t value, bool force) {
+	auto shadow = shadowRegister(controller, reg);
+	if (shadow && !force && __atomic_load_n(shadow, __ATOMIC_RELAXED) == (ShadowWritten | ShadowValid | value)) {
+		__atomic_fetch_add(&statistics.writesElided, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	controller.accessors->writeRegister32(controller.that, reg, value);
+	if (shadow) {
+		__atomic_store_n(shadow, ShadowWritten | ShadowValid | value, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&statistics.writesIssued, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void SmootherCore::notePwmFrequency(BacklightController &controller, uint32_t frequency) {
+	if (frequency) {
+		__atomic_store_n(&controller.shadowSuspended, false, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_store_n(&controller.shadowSuspended, true, __ATOMIC_RELEASE);
+	dropShadowRegisters(controller);
+}
+
+void SmootherCore::dropShadowRegisters(BacklightController &controller) {
+	for (auto &shadow : controller.shadowRegisters) {
+		__atomic_store_n(&shadow, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void SmootherCore::traceRegister(TraceSource source, BacklightController &controller, uint32_t reg, uint32_t value, uint32_t rescaled) {
+	if (!traceEnabled) {
+		return;
+	}
+
+	uint32_t depth = controller.requestQueue.count();
+	uint32_t sequence = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+	auto &record = traceRing[sequence & (TRACE_RECORDS - 1)];
+	// Mark the record invalid while it is filled in, dumpTrace compares the sequence before and after copying.
+	__atomic_store_n(&record.sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record.timestamp = platform.currentTimeNs();
+	record.reg = reg;
+	record.value = value;
+	record.rescaled = rescaled;
+	record.queueDepth = static_cast<uint16_t>(depth);
+	record.source = source;
+	for (auto &byte : record.reserved) {
+		byte = 0;
+	}
+	__atomic_store_n(&record.sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+size_t SmootherCore::traceDumpSize() {
+	uint32_t head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+	uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+	return sizeof(SmootherTraceHeader) + count * sizeof(SmootherTraceRecord);
+}
+
+size_t SmootherCore::dumpTrace(void *buffer, size_t size) {
+	if (size < sizeof(SmootherTraceHeader)) {
+		return 0;
+	}
+
+	uint32_t head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+	uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+	size_t room = (size - sizeof(SmootherTraceHeader)) / sizeof(SmootherTraceRecord);
+	if (count > room) {
+		count = static_cast<uint32_t>(room);
+	}
+
+	auto header = static_cast<SmootherTraceHeader *>(buffer);
+	auto records = reinterpret_cast<SmootherTraceRecord *>(header + 1);
+	uint32_t valid = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t sequence = head - count + i + 1;
+		auto &record = traceRing[(sequence - 1) & (TRACE_RECORDS - 1)];
+		if (__atomic_load_n(&record.sequence, __ATOMIC_ACQUIRE) != sequence) {
+			continue;
+		}
+		records[valid] = record;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		// A writer claimed the slot during the copy, the copy may be torn.
+		if (__atomic_load_n(&record.sequence, __ATOMIC_RELAXED) != sequence) {
+			continue;
+		}
+		records[valid].sequence = sequence;
+		valid++;
+	}
+
+	*header = {TraceMagic, TraceVersion, sizeof(SmootherTraceRecord), valid, head - valid};
+	return sizeof(SmootherTraceHeader) + valid * sizeof(SmootherTraceRecord);
+}
+
+void SmootherCore::pushQueue(BacklightController &controller, uint32_t value, uint32_t mask) {
+	if (controller.lastRequestedBacklightValue == value) {
+		return;
+	}
+
+	uint64_t now = platform.currentTimeNs();
+	controller.lastRequestedBacklightValue = value;
+	__atomic_store_n(&controller.latestRequest, (static_cast<uint64_t>(mask) << 32U) | value, __ATOMIC_RELEASE);
+
+	if (holdRequest(controller, now)) {
+		// The timer forwards the newest held request from latestRequest once the hold window is over.
+		__atomic_fetch_add(&statistics.heldRequests, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&controller.requestHeld, true, __ATOMIC_SEQ_CST);
+		if (!__atomic_exchange_n(&timerArmed, true, __ATOMIC_ACQ_REL)) {
+			uint64_t release = __atomic_load_n(&controller.forwardTime, __ATOMIC_ACQUIRE) + configuration.filterHoldMs * 1000000ULL;
+			armTimer(now, release > now ? release - now : 0);
+		}
+		return;
+	}
+
+	__atomic_fetch_add(&statistics.appliedRequests, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&controller.requestHeld, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&controller.forwardTime, now, __ATOMIC_RELEASE);
+	if (!controller.requestQueue.push(BacklightRequest(mask, value, now))) {
+		// The timer will pick the newest request up from latestRequest.
+		__atomic_store_n(&controller.requestDropped, true, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&statistics.queueOverflowCount, 1, __ATOMIC_RELAXED);
+	}
+
+	uint32_t depth = controller.requestQueue.count();
+	if (depth > __atomic_load_n(&statistics.queueHighWater, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&statistics.queueHighWater, depth, __ATOMIC_RELAXED);
+	}
+
+	if (!__atomic_exchange_n(&timerArmed, true, __ATOMIC_ACQ_REL)) {
+		armTimer(now, configuration.tickMs * 1000000ULL);
+	}
+}
+
+bool SmootherCore::holdRequest(BacklightController &controller, uint64_t now) {
+	uint64_t hold = configuration.filterHoldMs * 1000000ULL;
+	uint64_t forwardTime = __atomic_load_n(&controller.forwardTime, __ATOMIC_ACQUIRE);
+	return hold && forwardTime && now < forwardTime + hold;
+}
+
+bool SmootherCore::withinFilterDelta(BacklightController &controller, const DutyTable &table, uint32_t value) {
+	uint32_t minDelta = configuration.filterDelta;
+	if (!minDelta) {
+		return false;
+	}
+
+	// Compare positions on the duty table, so the threshold means the same perceived change everywhere on the curve.
+	// The driver thread never reads the table, so this runs on the timer where applyConfiguration cannot swap it.
+	int64_t delta = tablePosition(table, value) - tablePosition(table, controller.forwardedValue);
+	return delta > -(static_cast<int64_t>(minDelta) << 16) && delta < (static_cast<int64_t>(minDelta) << 16);
+}
+
+uint64_t SmootherCore::releaseHeldRequest(BacklightController &controller, uint64_t now) {
+	if (!__atomic_load_n(&controller.requestHeld, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	uint64_t release = __atomic_load_n(&controller.forwardTime, __ATOMIC_ACQUIRE) + configuration.filterHoldMs * 1000000ULL;
+	if (now < release) {
+		return release;
+	}
+
+	// Hand the newest request over like an overflowed one, dischargeController reads it from latestRequest.
+	if (__atomic_exchange_n(&controller.requestHeld, false, __ATOMIC_ACQ_REL)) {
+		__atomic_fetch_add(&statistics.appliedRequests, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&controller.forwardTime, now, __ATOMIC_RELEASE);
+		__atomic_store_n(&controller.requestDropped, true, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+void SmootherCore::armTimer(uint64_t now, uint64_t delay) {
+	// Only the side owning timerArmed gets here, so the deadline has a single writer.
+	// Rounding up to whole microseconds keeps the timer from firing before the step it was armed for.
+	uint64_t us = (delay + 999) / 1000;
+	if (us > UINT32_MAX) {
+		us = UINT32_MAX;
+	}
+	timerDeadline = now + us * 1000;
+	platform.scheduleTimer(static_cast<uint32_t>(us));
+}
+
+void SmootherCore::retargetTransition(BacklightController &controller, uint32_t mask, uint32_t value, uint64_t timestamp) {
+	auto &transition = controller.transition;
+	if (configuration.springMs && transition.spring) {
+		// Keep position and velocity, the settle time counts from the newest request.
+		transition.mask = mask;
+		transition.targetValue = value;
+		transition.startTime = timestamp;
+		return;
+	}
+
+	// Continue from the value the panel is showing, the table position is resolved on the next tick.
+	transition = BacklightTransition(mask, controller.currentBacklightValue, value, timestamp);
+}
+
+uint32_t SmootherCore::planTransitionSteps(uint32_t span) {
+	uint32_t budget = configuration.writeBudget;
+	if (configuration.durationMs) {
+		// More values than timer ticks would be skipped anyway.
+		uint32_t ticks = configuration.durationMs / configuration.tickMs;
+		if (ticks == 0) {
+			ticks = 1;
+		}
+		if (budget == 0 || budget > ticks) {
+			budget = ticks;
+		}
+	}
+
+	if (budget == 0) {
+		return span;
+	}
+
+	uint32_t steps = static_cast<uint32_t>((static_cast<uint64_t>(span) * budget + STEPS - 1) / STEPS);
+	if (steps < MIN_WRITES) {
+		steps = MIN_WRITES;
+	}
+	return steps < span ? steps : span;
+}
+
+const SmootherCore::TransitionPlan &SmootherCore::transitionPlan(BacklightController &controller, const DutyTable &table, uint32_t generation, uint32_t from, uint32_t to) {
+	// Brightness keys move between a few fixed levels, so the same pairs come back all the time.
+	// Levels are often evenly spaced, so the slot mixes both values instead of depending on their difference.
+	auto &plan = controller.planCache[((from * 0x9E3779B1U) ^ (to * 0x85EBCA6BU)) >> (32 - PLAN_CACHE_BITS)];
+	if (plan.generation == generation && plan.from == from && plan.to == to) {
+		statistics.planCacheHits++;
+		return plan;
+	}
+
+	statistics.planCacheMisses++;
+	int last;
+	if (from < to) {
+		plan.direction = 1;
+		plan.index = dutyUpperBound(table, from);
+		last = dutyLowerBound(table, to) - 1;
+	} else {
+		plan.direction = -1;
+		plan.index = dutyLowerBound(table, from) - 1;
+		last = dutyUpperBound(table, to);
+	}
+	int between = (last - plan.index) * plan.direction + 1;
+	plan.span = (between > 0 ? between : 0) + 1;
+	plan.from = from;
+	plan.to = to;
+	plan.generation = generation;
+	return plan;
+}
+
+TransitionStep SmootherCore::nextTransitionValue(BacklightController &controller, uint64_t now, uint32_t &value) {
+	if (configuration.springMs) {
+		return nextSpringValue(controller, now, value);
+	}
+
+	auto &transition = controller.transition;
+	// generateTables publishes the table before bumping the generation. Loading them the other way round means
+	// a table older than the generation is never seen, so a stale plan cannot be cached as current.
+	uint32_t generation = __atomic_load_n(&controller.tableGeneration, __ATOMIC_ACQUIRE);
+	auto table = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+	if (transition.direction != 0 && (transition.spring || generation != controller.transitionGeneration)) {
+		// The table was swapped or the spring was switched off, plan the rest of the way again from the value the panel is showing.
+		transition = BacklightTransition(transition.mask, controller.currentBacklightValue, transition.targetValue, now);
+	}
+
+	if (transition.direction == 0) {
+		controller.transitionGeneration = generation;
+		auto &plan = transitionPlan(controller, *table, generation, transition.startValue, transition.targetValue);
+		transition.index = plan.index;
+		transition.direction = plan.direction;
+		transition.span = plan.span;
+		transition.steps = planTransitionSteps(transition.span);
+		transition.stepInterval = configuration.tickMs * 1000000ULL * transition.span / transition.steps;
+	}
+
+	// Step p of the plan shows the table entry p * span / steps entries away from the start, the last step shows the target.
+	auto valueAt = [table, &transition](uint32_t position) {
+		if (position >= transition.steps) {
+			return transition.targetValue;
+		}
+		int offset = static_cast<int>(static_cast<uint64_t>(position) * transition.span / transition.steps) - 1;
+		return table->values[transition.index + transition.direction * offset];
+	};
+
+	uint32_t position;
+	if (configuration.durationMs) {
+		// Pick the step matching the elapsed time, steps the timer was too late for are skipped.
+		uint64_t duration = configuration.durationMs * 1000000ULL;
+		uint64_t elapsed = now > transition.startTime ? now - transition.startTime : 0;
+		position = transition.steps;
+		if (elapsed < duration) {
+			position = static_cast<uint32_t>((transition.steps * elapsed + duration - 1) / duration);
+		}
+		if (position <= transition.position) {
+			return TransitionStep::Wait;
+		}
+	} else {
+		// One step per interval, plus one for every whole interval the timer fired late so the fade catches up.
+		// Due times stay on the grid of the first step, so lateness below an interval is caught up on a later tick.
+		if (!transition.dueTime) {
+			// The first step was due a tick after the request, or now when the timer was already armed for an earlier one.
+			uint64_t first = transition.startTime + configuration.tickMs * 1000000ULL;
+			transition.dueTime = first < now ? first : now;
+		} else if (now < transition.dueTime) {
+			return TransitionStep::Wait;
+		}
+		uint32_t late = static_cast<uint32_t>((now - transition.dueTime) / transition.stepInterval);
+		position = transition.position + 1 + late;
+		statistics.catchUpSteps += late;
+
+		// Skip duplicate entries at the dark end of the table
+		while (position < transition.steps && valueAt(position) == controller.currentBacklightValue) {
+			position++;
+		}
+	}
+
+	transition.position = position;
+	value = valueAt(position);
+	if (position >= transition.steps) {
+		return TransitionStep::Finish;
+	}
+	return value == controller.currentBacklightValue ? TransitionStep::Wait : TransitionStep::Write;
+}
+
+int64_t SmootherCore::tablePosition(const DutyTable &table, uint32_t value) {
+	int index = dutyLowerBound(table, value);
+	if (index == 0) {
+		return 0;
+	}
+	if (index >= static_cast<int>(STEPS)) {
+		return static_cast<int64_t>(STEPS - 1) << 16;
+	}
+	uint32_t low = table.values[index - 1], high = table.values[index];
+	if (high == low) {
+		return static_cast<int64_t>(index - 1) << 16;
+	}
+	return (static_cast<int64_t>(index - 1) << 16) + (static_cast<int64_t>(value - low) << 16) / (high - low);
+}
+
+uint32_t SmootherCore::valueAtPosition(const DutyTable &table, int64_t position) {
+	if (position <= 0) {
+		return table.values[0];
+	}
+	uint32_t index = static_cast<uint32_t>(position >> 16);
+	if (index >= STEPS - 1) {
+		return table.values[STEPS - 1];
+	}
+	uint32_t low = table.values[index], high = table.values[index + 1];
+	return low + static_cast<uint32_t>((static_cast<uint64_t>(high - low) * (position & 0xffff)) >> 16);
+}
+
+TransitionStep SmootherCore::nextSpringValue(BacklightController &controller, uint64_t now, uint32_t &value) {
+	auto &transition = controller.transition;
+	auto table = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+	if (transition.direction != 0 && !transition.spring) {
+		// The spring was switched on during a table walk, settle from the value the panel is showing.
+		transition = BacklightTransition(transition.mask, controller.currentBacklightValue, transition.targetValue, now);
+	}
+	if (transition.direction == 0) {
+		// Start at rest on the value the panel is showing.
+		transition.spring = true;
+		transition.direction = 1;
+		transition.springPosition = tablePosition(*table, controller.currentBacklightValue);
+		transition.springVelocity = 0;
+		transition.springTime = transition.startTime;
+	} else if (now < transition.dueTime) {
+		return TransitionStep::Wait;
+	}
+
+	uint64_t settle = configuration.springMs * 1000000ULL;
+	int64_t target = tablePosition(*table, transition.targetValue);
+	int64_t offset = transition.springPosition - target;
+	if (now - transition.startTime >= settle) {
+		value = transition.targetValue;
+		return TransitionStep::Finish;
+	}
+
+	// x(tau) = target + (c1 + c2 * tau) * e ^ -tau and x'(tau) = (v0 - c2 * tau) * e ^ -tau with c1 = x0 - target and c2 = v0 + c1.
+	// Past the settle time the spring is at rest.
+	uint64_t elapsed = now - transition.springTime;
+	if (elapsed > settle) {
+		elapsed = settle;
+	}
+	// Drop low bits of both times for settle times beyond 2 ^ 44 ns, so elapsed * SPRING_SETTLE stays within 64 bits.
+	uint64_t scale = settle;
+	while (scale >> 44) {
+		scale >>= 1;
+		elapsed >>= 1;
+	}
+	int64_t tau = static_cast<int64_t>(elapsed * SPRING_SETTLE / scale);
+	int64_t decay = SmootherCurves::exp2Fixed(static_cast<int32_t>(-((tau * LOG2E) >> 16)));
+	int64_t c2 = transition.springVelocity + offset;
+	int64_t c2tau = (c2 * tau) >> 16;
+	offset = ((offset + c2tau) * decay) >> SmootherCurves::FRACTION_BITS;
+	transition.springVelocity = ((transition.springVelocity - c2tau) * decay) >> SmootherCurves::FRACTION_BITS;
+	transition.springPosition = target + offset;
+	transition.springTime = now;
+
+	// Close enough to the target and slow enough not to move past it, show the exact target.
+	if (offset > -0x8000 && offset < 0x8000 && transition.springVelocity > -0x10000 && transition.springVelocity < 0x10000) {
+		value = transition.targetValue;
+		return TransitionStep::Finish;
+	}
+
+	// Spend the write budget evenly over the table, a full range move takes about writeBudget writes.
+	if (configuration.writeBudget) {
+		int64_t moved = transition.springPosition - tablePosition(*table, controller.currentBacklightValue);
+		int64_t spacing = (static_cast<int64_t>(STEPS) << 16) / configuration.writeBudget;
+		if (moved > -spacing && moved < spacing) {
+			return TransitionStep::Wait;
+		}
+	}
+
+	value = valueAtPosition(*table, transition.springPosition);
+	return value == controller.currentBacklightValue ? TransitionStep::Wait : TransitionStep::Write;
+}
+
+uint64_t SmootherCore::dischargeController(BacklightController &controller, uint64_t now) {
+	auto &transition = controller.transition;
+
+	auto table = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+	if (!table) {
+		// The work loop is still building the tables, merge early requests into the newest one until they are ready.
+		BacklightRequest request;
+		bool merged = __atomic_load_n(&controller.requestDropped, __ATOMIC_ACQUIRE);
+		while (controller.requestQueue.fetch(request)) {
+			if (merged) {
+				statistics.staleRequestCount++;
+			}
+			merged = true;
+		}
+		if (!merged) {
+			return 0;
+		}
+		__atomic_store_n(&controller.requestDropped, true, __ATOMIC_RELEASE);
+		return now + configuration.tickMs * 1000000ULL;
+	}
+
+	// Only the newest request matters, older ones are superseded.
+	BacklightRequest request;
+	bool hasRequest = false;
+	while (controller.requestQueue.fetch(request)) {
+		if (hasRequest) {
+			statistics.staleRequestCount++;
+		}
+		hasRequest = true;
+	}
+
+	if (__atomic_exchange_n(&controller.requestDropped, false, __ATOMIC_ACQ_REL)) {
+		uint64_t latest = __atomic_load_n(&controller.latestRequest, __ATOMIC_ACQUIRE);
+		if (!hasRequest) {
+			request.timestamp = now;
+		}
+		request.mask = static_cast<uint32_t>(latest >> 32U);
+		request.value = static_cast<uint32_t>(latest);
+		hasRequest = true;
+	}
+
+	// The driver may stamp a request after this tick read the clock, treat it as made now.
+	if (hasRequest && request.timestamp > now) {
+		request.timestamp = now;
+	}
+
+	if (hasRequest) {
+		if (withinFilterDelta(controller, *table, request.value)) {
+			// Too small a change, the next larger one picks it up.
+			statistics.filteredRequests++;
+			hasRequest = false;
+		} else {
+			controller.forwardedValue = request.value;
+		}
+	}
+
+	if (hasRequest) {
+		if (!controller.transitionActive) {
+			if (request.value != controller.currentBacklightValue) {
+				transition = BacklightTransition(request.mask, controller.currentBacklightValue, request.value, request.timestamp);
+				controller.transitionActive = true;
+			}
+		} else if (request.value != transition.targetValue || request.mask != transition.mask) {
+			if (!configuration.springMs) {
+				// A spring keeps going as one transition.
+				statistics.writesPerTransition.record(transition.written);
+				statistics.wakeupsPerTransition.record(transition.wakeups);
+			}
+			retargetTransition(controller, request.mask, request.value, request.timestamp);
+			statistics.retargetCount++;
+		}
+	}
+
+	if (!controller.transitionActive) {
+		return 0;
+	}
+
+	transition.wakeups++;
+	uint32_t value;
+	auto step = nextTransitionValue(controller, now, value);
+	if (step != TransitionStep::Wait) {
+		writeRegister32(controller, controller.dutyRegister, transition.mask | value);
+		traceRegister(TraceSource::Timer, controller, controller.dutyRegister, transition.mask | value, value);
+		controller.currentBacklightValue = value;
+		if (transition.written++ == 0) {
+			statistics.firstWriteLatency.record(microsecondsSince(transition.startTime, now));
+		}
+		DBGLOG("smoother", "dischargeQueue set backlight register 0x%x to 0x%x", controller.dutyRegister, transition.mask | value);
+	}
+
+	if (step == TransitionStep::Finish) {
+		statistics.transitionCount++;
+		statistics.finalWriteLatency.record(microsecondsSince(transition.startTime, now));
+		statistics.writesPerTransition.record(transition.written);
+		statistics.wakeupsPerTransition.record(transition.wakeups);
+		controller.transitionActive = false;
+		return 0;
+	}
+
+	// Ask for the timer when the next step is due, in deadline mode ticks in between would not change the value.
+	bool deadline = configuration.durationMs && transition.steps;
+	if (deadline || now >= transition.dueTime) {
+		// Without a duration, a transition that skips table entries still takes as long as walking all of them.
+		uint64_t interval = !deadline && transition.stepInterval ? transition.stepInterval : configuration.tickMs * 1000000ULL;
+		uint64_t due = now + interval;
+		if (!deadline && !configuration.springMs && transition.dueTime) {
+			// Stay on the step grid, the part of an interval the timer was late by is not lost on every step.
+			due = transition.dueTime + ((now - transition.dueTime) / interval + 1) * interval;
+		}
+		if (deadline) {
+			uint64_t next = transition.startTime + transition.position * (configuration.durationMs * 1000000ULL) / transition.steps + 1;
+			if (next > due) {
+				due = next;
+			}
+		}
+		transition.dueTime = due;
+	}
+	return transition.dueTime;
+}
+
+void SmootherCore::dischargeQueue() {
+	uint64_t now = platform.currentTimeNs();
+	uint64_t lateness = now > timerDeadline ? now - timerDeadline : 0;
+	statistics.tickCount++;
+	statistics.tickLatenessTotal += lateness;
+	statistics.tickLatenessLast = lateness;
+	if (lateness > statistics.tickLatenessMax) {
+		statistics.tickLatenessMax = lateness;
+	}
+	statistics.tickLateness.record(lateness / 1000);
+	if (platform.publishState) {
+		platform.publishState();
+	}
+
+	if (__atomic_load_n(&systemSleeping, __ATOMIC_ACQUIRE)) {
+		// Requests racing with the sleep notification are dropped, the driver sets the brightness again on wake.
+		for (auto &controller : controllers) {
+			if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE)) {
+				cancelTransition(controller);
+			}
+		}
+		__atomic_store_n(&timerArmed, false, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	uint64_t due = 0;
+	for (auto &controller : controllers) {
+		if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE)) {
+			uint64_t release = releaseHeldRequest(controller, now);
+			uint64_t next = dischargeController(controller, now);
+			if (release && (next == 0 || release < next)) {
+				next = release;
+			}
+			if (next && (due == 0 || next < due)) {
+				due = next;
+			}
+		}
+	}
+
+	if (due) {
+		// Fire a little later when that lets one wakeup serve every controller due shortly after the first.
+		uint64_t deadline = due;
+		for (auto &controller : controllers) {
+			uint64_t next = controller.transitionActive ? controller.transition.dueTime : 0;
+			if (next > deadline && next <= due + TIMER_LEEWAY_MS * 1000000ULL) {
+				deadline = next;
+			}
+		}
+		uint64_t delay = deadline > now ? deadline - now : 0;
+		armTimer(now, delay);
+		return;
+	}
+
+	// Going idle, make sure a request pushed meanwhile still gets a timer.
+	__atomic_store_n(&timerArmed, false, __ATOMIC_SEQ_CST);
+	bool pending = false;
+	for (auto &controller : controllers) {
+		if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE) &&
+			(!controller.requestQueue.isEmpty() || __atomic_load_n(&controller.requestDropped, __ATOMIC_SEQ_CST) ||
+			 __atomic_load_n(&controller.requestHeld, __ATOMIC_SEQ_CST))) {
+			pending = true;
+		}
+	}
+	if (pending && !__atomic_exchange_n(&timerArmed, true, __ATOMIC_ACQ_REL)) {
+		armTimer(now, configuration.tickMs * 1000000ULL);
+	}
+}
+
+void SmootherCore::cancelTransition(BacklightController &controller) {
+	BacklightRequest request;
+	while (controller.requestQueue.fetch(request)) {
+		statistics.staleRequestCount++;
+	}
+	__atomic_store_n(&controller.requestDropped, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&controller.requestHeld, false, __ATOMIC_RELEASE);
+
+	if (controller.transitionActive) {
+		controller.transitionActive = false;
+		statistics.sleepCancelCount++;
+	}
+}
+
+void SmootherCore::systemWillSleep() {
+	__atomic_store_n(&systemSleeping, true, __ATOMIC_SEQ_CST);
+	for (auto &controller : controllers) {
+		if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE)) {
+			cancelTransition(controller);
+		}
+	}
+	DBGLOG("smoother", "systemWillSleep: pending transitions cancelled");
+}
+
+void SmootherCore::systemDidWake() {
+	wakeTime = platform.currentTimeNs();
+	for (auto &controller : controllers) {
+		if (__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&controller.restorePending, true, __ATOMIC_RELEASE);
+		}
+	}
+	__atomic_store_n(&systemSleeping, false, __ATOMIC_SEQ_CST);
+	statistics.wakeCount++;
+}
+
+bool SmootherCore::passThrough(BacklightController &controller, uint32_t value) {
+	if (__atomic_load_n(&systemSleeping, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+
+	if (!__atomic_load_n(&controller.restorePending, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	// The PWM was just reinitialised, show the driver's first real brightness at once instead of fading to it.
+	if (value && __atomic_exchange_n(&controller.restorePending, false, __ATOMIC_ACQ_REL)) {
+		uint64_t current = platform.currentTimeNs();
+		uint64_t latency = current > wakeTime ? current - wakeTime : 0;
+		__atomic_store_n(&statistics.wakeLatencyLast, latency, __ATOMIC_RELAXED);
+		statistics.wakeLatency.record(latency / 1000);
+		DBGLOG("smoother", "passThrough: backlight on 0x%x, %llu us after wake", value, latency / 1000);
+	}
+	return true;
+}
+
+void SmootherCore::captureTargetFrequency(BacklightController &controller, bool packed, const char *name) {
+	// Save the hardware PWM frequency as initially set up by the system firmware.
+	// We'll need this to restore later after system sleep.
+	uint32_t frequency = readRegister32(controller, BXT_BLC_PWM_FREQ1);
+	if (packed) {
+		// High 16 of this register are the denominator (frequency), low 16 are the numerator (duty cycle).
+		frequency = (frequency & 0xffff0000U) >> 16U;
+	}
+	DBGLOG("smoother", "wrap%sWriteRegister32: system initialized PWM frequency = 0x%x", name, frequency);
+
+	if (frequency == 0) {
+		// This should not happen with correctly written bootloader code, but in case it does, let's use a failsafe default value.
+		frequency = FallbackTargetBacklightFrequency;
+		SYSLOG("smoother", "wrap%sWriteRegister32: system initialized PWM frequency is ZERO", name);
+	}
+
+	// The work loop and the driver may both get here first, they read the same value.
+	uint32_t expected = 0;
+	__atomic_compare_exchange_n(&controller.targetBacklightFrequency, &expected, frequency, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void SmootherCore::requestPrepare(BacklightController &controller, bool packed) {
+	controller.hardwarePacked = packed;
+	if (!__atomic_exchange_n(&controller.prepareRequested, true, __ATOMIC_ACQ_REL) && platform.schedulePrepare) {
+		platform.schedulePrepare();
+	}
+}
+
+bool SmootherCore::deferWrite(BacklightController &controller, size_t slot, void (*translator)(void *, uint32_t, uint32_t), uint32_t reg, uint32_t value) {
+	__atomic_store_n(&controller.deferredTranslator, translator, __ATOMIC_RELEASE);
+	__atomic_store_n(&controller.deferredWrites[slot], (static_cast<uint64_t>(reg) << 32U) | value, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&controller.targetBacklightFrequency, __ATOMIC_ACQUIRE) == 0) {
+		return true;
+	}
+	// The work loop captured the frequency in the meantime and may have replayed before the store, take the write back unless it did.
+	return __atomic_exchange_n(&controller.deferredWrites[slot], 0, __ATOMIC_ACQ_REL) == 0;
+}
+
+void SmootherCore::prepareControllers() {
+	for (auto &controller : controllers) {
+		if (!__atomic_load_n(&controller.that, __ATOMIC_ACQUIRE) || !__atomic_load_n(&controller.prepareRequested, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		if (__atomic_load_n(&controller.targetBacklightFrequency, __ATOMIC_ACQUIRE) == 0) {
+			captureTargetFrequency(controller, controller.hardwarePacked, "Prepare");
+		}
+		generateTables(controller);
+		DBGLOG("smoother", "prepareControllers: duty table for %p ready, PWM frequency = 0x%x", controller.that, controller.targetBacklightFrequency);
+
+		// Apply what the driver wrote before the frequency was known, the frequency first as the driver did.
+		auto translator = __atomic_load_n(&controller.deferredTranslator, __ATOMIC_ACQUIRE);
+		for (auto &deferred : controller.deferredWrites) {
+			uint64_t write = __atomic_exchange_n(&deferred, 0, __ATOMIC_ACQ_REL);
+			if (write && translator) {
+				translator(controller.that, static_cast<uint32_t>(write >> 32U), static_cast<uint32_t>(write));
+			}
+		}
+	}
+}
+
+template <class Traits>
+void SmootherCore::wrapWriteRegister32(void *that, uint32_t reg, uint32_t value) {
+	auto slot = controllerFor(that, Traits::DutyRegister, &layoutAccessors<Traits>);
+	if (!slot) {
+		// Without a slot there is no state to translate or smooth with.
+		layoutAccessors<Traits>.writeRegister32(that, reg, value);
+		return;
+	}
+	auto &controller = *slot;
+	if (!__atomic_load_n(&controller.prepareRequested, __ATOMIC_ACQUIRE)) {
+		requestPrepare(controller, Traits::HardwarePacked);
+	}
+	bool force = false;
+
+	if (reg == BXT_BLC_PWM_FREQ1) {
+		// The driver either writes the frequency alone or packs it with the duty cycle.
+		uint32_t frequency = Traits::DriverPacked ? (value & 0xffff0000U) >> 16U : value;
+
+		if (frequency && frequency != controller.driverBacklightFrequency) {
+			DBGLOG("smoother", "wrap%sWriteRegister32: driver requested PWM frequency = 0x%x", Traits::Name, frequency);
+			controller.driverBacklightFrequency = frequency;
+		}
+
+		if (__atomic_load_n(&controller.targetBacklightFrequency, __ATOMIC_ACQUIRE) == 0) {
+			// The work loop did not get to this controller yet, it reads the firmware value and replays the write.
+			if (platform.schedulePrepare && deferWrite(controller, 0, wrapWriteRegister32<Traits>, reg, value)) {
+				return;
+			}
+			// Without a work loop the value is needed right now.
+			captureTargetFrequency(controller, Traits::HardwarePacked, Traits::Name);
+		}
+		if (!platform.schedulePrepare && !controller.dutyTable) {
+			generateTables(controller);
+		}
+
+		// Nonzero writes to PWM frequency need to use the original system value.
+		// Yet the driver can safely write zero as part of system sleep.
+		uint32_t hardwareFrequency = frequency ? controller.targetBacklightFrequency : 0;
+		notePwmFrequency(controller, hardwareFrequency);
+
+		if (!Traits::DriverPacked) {
+			traceRegister(TraceSource::Driver, controller, reg, value, 0);
+			// Keep the duty cycle when the hardware packs it into the same register.
+			value = Traits::HardwarePacked ? (hardwareFrequency << 16U) | (readRegister32(controller, BXT_BLC_PWM_FREQ1) & 0xffffU) : hardwareFrequency;
+		} else {
+			uint32_t dutyCycle = value & 0xffffU;
+			uint32_t rescaledValue = frequency == 0 ? 0 : rescaleDuty(controller, dutyCycle, frequency);
+			DBGLOG("smoother", "wrap%sWriteRegister32: write PWM duty 0x%x/0x%x, rescaled to 0x%x/0x%x", Traits::Name, dutyCycle, frequency, rescaledValue, controller.targetBacklightFrequency);
+			traceRegister(TraceSource::Driver, controller, reg, value, rescaledValue);
+
+			uint32_t mask = 0;
+			if (Traits::HardwarePacked) {
+				mask = hardwareFrequency << 16U;
+			} else {
+				// Split the write for hardware with a separate duty register, frequency first.
+				writeRegister32(controller, BXT_BLC_PWM_FREQ1, hardwareFrequency);
+			}
+
+			if (isSmoothingAvailable() && controller.backlightValueAssigned && !passThrough(controller, rescaledValue)) {
+				pushQueue(controller, rescaledValue, mask);
+				return;
+			}
+
+			reg = Traits::DutyRegister;
+			value = mask | rescaledValue;
+			controller.backlightValueAssigned = true;
+			controller.lastRequestedBacklightValue = controller.currentBacklightValue = controller.forwardedValue = rescaledValue;
+		}
+	} else if (!Traits::DriverPacked && reg == Traits::DriverDutyRegister) {
+		if (platform.schedulePrepare && __atomic_load_n(&controller.targetBacklightFrequency, __ATOMIC_ACQUIRE) == 0 &&
+			deferWrite(controller, 1, wrapWriteRegister32<Traits>, reg, value)) {
+			return;
+		}
+		if (controller.driverBacklightFrequency && controller.targetBacklightFrequency) {
+			// Translate the PWM duty cycle between the driver scale value and the HW scale value
+			uint32_t rescaledValue = rescaleDuty(controller, value, controller.driverBacklightFrequency);
+			DBGLOG("smoother", "wrap%sWriteRegister32: write PWM duty 0x%x/0x%x, rescaled to 0x%x/0x%x", Traits::Name, value, controller.driverBacklightFrequency, rescaledValue, controller.targetBacklightFrequency);
+			traceRegister(TraceSource::Driver, controller, reg, value, rescaledValue);
+
+			// Keep the current frequency when the hardware packs it into the duty register.
+			uint32_t mask = Traits::HardwarePacked ? readRegister32(controller, BXT_BLC_PWM_FREQ1) & 0xffff0000U : 0;
+
+			if (isSmoothingAvailable() && controller.backlightValueAssigned && !passThrough(controller, rescaledValue)) {
+				pushQueue(controller, rescaledValue, mask);
+				return;
+			}
+
+			reg = Traits::DutyRegister;
+			value = mask | rescaledValue;
+			controller.backlightValueAssigned = true;
+			controller.lastRequestedBacklightValue = controller.currentBacklightValue = controller.forwardedValue = rescaledValue;
+		} else {
+			// This should never happen, but in case it does we should log it at the very least.
+			SYSLOG("smoother", "wrap%sWriteRegister32: write PWM duty has zero frequency driver (%d) target (%d)", Traits::Name, controller.driverBacklightFrequency, controller.targetBacklightFrequency);
+		}
+	} else if (Traits::RestoresPwmControl && reg == BXT_BLC_PWM_CTL1) {
+		// Switching the PWM off and on again must reach the hardware even when the values look unchanged.
+		force = true;
+		if (controller.targetPwmControl == 0) {
+			// Save the original hardware PWM control value
+			controller.targetPwmControl = readRegister32(controller, BXT_BLC_PWM_CTL1);
+		}
+
+		DBGLOG("smoother", "wrap%sWriteRegister32: write BXT_BLC_PWM_CTL1 0x%x, previous was 0x%x", Traits::Name, value, readRegister32(controller, BXT_BLC_PWM_CTL1));
+		traceRegister(TraceSource::Driver, controller, reg, value, 0);
+
+		if (value) {
+			// Set the PWM frequency before turning it on to avoid the 3 minute blackout bug
+			notePwmFrequency(controller, controller.targetBacklightFrequency);
+			writeRegister32(controller, BXT_BLC_PWM_FREQ1, controller.targetBacklightFrequency, true);
+
+			// Use the original hardware PWM control value.
+			value = controller.targetPwmControl;
+		} else {
+			// The panel may lose its PWM state while it is off.
+			dropShadowRegisters(controller);
+		}
+	}
+
+	writeRegister32(controller, reg, value, force);
+}
+
+template void SmootherCore::wrapWriteRegister32<IvyBacklightTraits>(void *that, uint32_t reg, uint32_t value);
+template void SmootherCore::wrapWriteRegister32<HswBacklightTraits>(void *that, uint32_t reg, uint32_t value);
+template void SmootherCore::wrapWriteRegister32<KblFakeBacklightTraits>(void *that, uint32_t reg, uint32_t value);
+template void SmootherCore::wrapWriteRegister32<CflRealBacklightTraits>(void *that, uint32_t reg, uint32_t value);
+template void SmootherCore::wrapWriteRegister32<CflFakeBacklightTraits>(void *that, uint32_t reg, uint32_t value);
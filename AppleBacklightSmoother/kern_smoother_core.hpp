@@ -0,0 +1,717 @@
+//
+//  kern_smoother_core.hpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#ifndef kern_smoother_core_hpp
+#define kern_smoother_core_hpp
+
+#ifdef KERNEL
+#include <Headers/kern_util.hpp>
+#else
+// Allow building the smoothing engine outside of the kernel.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef SYSLOG
+#define SYSLOG(module, str, ...) printf("AppleBacklightSmoother %s: " str "\n", module, ## __VA_ARGS__)
+#endif
+
+#ifndef arrsize
+#define arrsize(array) (sizeof(array) / sizeof((array)[0]))
+#endif
+
+#ifndef DBGLOG
+#ifdef DEBUG
+#define DBGLOG(module, str, ...) SYSLOG(module, str, ## __VA_ARGS__)
+#else
+#define DBGLOG(module, str, ...) do { } while (0)
+#endif
+#endif
+#endif
+
+static constexpr uint32_t BLC_PWM_CPU_CTL = 0x48254;
+static constexpr uint32_t BXT_BLC_PWM_CTL1 = 0xC8250;
+static constexpr uint32_t BXT_BLC_PWM_FREQ1 = 0xC8254;
+static constexpr uint32_t BXT_BLC_PWM_DUTY1 = 0xC8258;
+
+/**
+ *  Wait-free single-producer/single-consumer ring.
+ *  push may only be called by the producer, fetch by the consumer.
+ */
+template <class T, unsigned N>
+class AtomicQueue {
+	static_assert(N > 0 && (N & (N - 1)) == 0, "AtomicQueue capacity must be a power of two");
+
+private:
+	T m_buffer[N];
+	unsigned m_head, m_tail;
+
+public:
+	inline AtomicQueue() { reset(); }
+	inline void reset() {
+		m_head = 0;
+		m_tail = 0;
+	}
+	inline unsigned count() {
+		return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+	}
+	inline bool isEmpty() {
+		return count() == 0;
+	}
+	bool push(const T &data) {
+		unsigned head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+		if (head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) >= N) {
+			return false;
+		}
+		m_buffer[head & (N - 1)] = data;
+		__atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+	bool fetch(T &data) {
+		unsigned tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+		if (tail == __atomic_load_n(&m_head, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+		data = m_buffer[tail & (N - 1)];
+		__atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+/**
+ *  A brightness request as seen by WriteRegister32
+ */
+struct BacklightRequest {
+	uint32_t mask;
+	uint32_t value;
+	uint64_t timestamp;
+
+	inline BacklightRequest() {}
+	inline BacklightRequest(uint32_t mask, uint32_t value, uint64_t timestamp): mask(mask), value(value), timestamp(timestamp) {}
+};
+
+/**
+ *  A brightness transition, interpolated over the duty table when the smoothing timer fires
+ */
+struct BacklightTransition {
+	uint32_t mask;
+	uint32_t startValue;
+	uint32_t targetValue;
+	uint64_t startTime;  // request time, deadline mode only
+	int index;           // first duty table index past startValue, valid once started
+	int direction;       // 0 until started, then 1 (up) or -1 (down)
+	uint32_t span;       // duty table entries between start and target, plus the target itself
+	uint32_t steps;      // values to write including the target, at most span
+	uint32_t position;   // steps taken so far
+	uint32_t written;    // register writes issued so far
+	uint32_t wakeups;    // timer ticks that advanced or checked the transition
+	uint64_t dueTime;    // when the transition next needs the timer, 0 until the first tick
+	uint64_t stepInterval;   // step mode: ns between steps, the tick stretched by span / steps to keep the pace of the full table walk
+	int64_t springPosition;  // spring mode: duty table position in 1/65536 entries
+	int64_t springVelocity;  // spring mode: 1/65536 entries per unit of spring time
+	uint64_t springTime;     // spring mode: when springPosition was last advanced
+	bool spring;             // started as a spring, the other fields follow the mode it was started in
+
+	inline BacklightTransition() {}
+	inline BacklightTransition(uint32_t mask, uint32_t startValue, uint32_t targetValue, uint64_t startTime): mask(mask), startValue(startValue), targetValue(targetValue), startTime(startTime), index(0), direction(0), span(0), steps(0), position(0), written(0), wakeups(0), dueTime(0), stepInterval(0), springPosition(0), springVelocity(0), springTime(0), spring(false) {}
+};
+
+/**
+ *  Outcome of advancing a transition
+ */
+enum class TransitionStep {
+	Wait,    // nothing new to write yet
+	Write,   // write the value, more values follow
+	Finish,  // write the value, the target is reached
+};
+
+/**
+ *  Shape of the duty table, see kern_smoother_curves.hpp
+ */
+enum class SmootherCurve : uint32_t {
+	Quadratic,
+	Cubic,
+	Gamma,
+	Exponential,
+	PerceptualLightness,
+};
+
+/**
+ *  Tunable engine behaviour
+ */
+struct SmootherConfiguration {
+	uint32_t durationMs;      // 0 walks one table entry per tick, otherwise every transition takes this long
+	SmootherCurve curve;      // duty table shape
+	uint32_t curveParameter;  // gamma * 100 or exponential base power, 0 picks the curve default
+	uint32_t writeBudget;     // writes for a full range transition, shorter ones get proportionally fewer, 0 writes every table entry
+	uint32_t pwmMax;          // PWM frequency to use instead of the firmware value, 0 keeps the firmware value
+	uint32_t tickMs;          // smoothing timer interval, at least 1
+	uint32_t springMs;        // settle time of the spring animation, 0 walks the duty table instead
+	uint32_t filterDelta;     // requests moving less than this many duty table entries are dropped, 0 keeps all
+	uint32_t filterHoldMs;    // requests within this time of the last forwarded one wait for the window to end, 0 forwards at once
+};
+
+/**
+ *  Power of two histogram: bucket 0 counts zeroes, bucket i counts values in [2 ^ (i - 1), 2 ^ i),
+ *  the last bucket also takes everything larger
+ */
+template <unsigned N>
+struct SmootherHistogram {
+	uint32_t buckets[N];
+
+	inline void record(uint64_t value) {
+		unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+		__atomic_fetch_add(&buckets[bucket < N ? bucket : N - 1], 1, __ATOMIC_RELAXED);
+	}
+};
+
+/**
+ *  Fixed point reciprocal for value * target / divisor: (value * multiplier) >> shift,
+ *  exact for values below 2 ^ 16, shift is 0 when the pair needs a real division
+ */
+struct SmootherReciprocal {
+	uint32_t target;
+	uint32_t divisor;
+	uint64_t multiplier;
+	uint32_t shift;
+};
+
+/**
+ *  Engine counters, cheap enough to keep in release builds.
+ *  Everything is updated with plain or atomic increments, the host publishes snapshots.
+ */
+struct SmootherStatistics {
+	static constexpr unsigned LatencyBuckets = 24;
+
+	uint32_t retargetCount;       // requests that changed the destination of a running transition
+	uint32_t queueOverflowCount;  // requests that did not fit into the request queue
+	uint32_t staleRequestCount;   // queued requests superseded before the timer applied them
+	uint32_t queueHighWater;      // deepest the request queue has been
+	uint32_t tickCount;           // smoothing timer callbacks
+	uint32_t transitionCount;     // transitions that reached their target
+	uint32_t writesIssued;        // PWM register writes that reached the hardware
+	uint32_t writesElided;        // PWM register writes skipped because the register already held the value
+	uint32_t catchUpSteps;        // extra steps taken because the timer fired later than a whole tick
+	uint32_t planCacheHits;       // transitions started from a cached plan
+	uint32_t planCacheMisses;     // transitions that had to search the duty table
+	uint32_t appliedRequests;     // requests the hold window handed to the timer
+	uint32_t filteredRequests;    // requests the timer dropped for moving less than filterDelta
+	uint32_t heldRequests;        // requests delayed by filterHoldMs, only the newest of a window is applied
+	uint32_t wakeCount;           // system wakes seen
+	uint32_t sleepCancelCount;    // transitions cancelled because the system went to sleep
+	uint64_t wakeLatencyLast;     // system power on to the first nonzero duty write of the most recent wake in ns
+	uint64_t tickLatenessTotal;   // sum of timer lateness in ns
+	uint64_t tickLatenessMax;     // worst timer lateness in ns
+	uint64_t tickLatenessLast;    // lateness of the most recent tick in ns
+	SmootherHistogram<LatencyBuckets> tickLateness;       // timer lateness in us
+	SmootherHistogram<LatencyBuckets> firstWriteLatency;  // request to first register write in us
+	SmootherHistogram<LatencyBuckets> finalWriteLatency;  // request to target value written in us
+	SmootherHistogram<10> writesPerTransition;            // register writes of each finished or retargeted transition
+	SmootherHistogram<10> wakeupsPerTransition;           // timer ticks of each finished or retargeted transition
+	SmootherHistogram<LatencyBuckets> wakeLatency;        // system power on to the first nonzero duty write in us
+};
+
+/**
+ *  Where a traced register write came from
+ */
+enum class TraceSource : uint8_t {
+	Driver,  // intercepted WriteRegister32 call, value is what the driver wrote
+	Timer,   // smoothing timer write, value is what reached the register
+};
+
+/**
+ *  One entry of the register trace, dumped as is (little endian, 32 bytes)
+ */
+struct SmootherTraceRecord {
+	uint64_t timestamp;   // currentTimeNs
+	uint32_t sequence;    // position in the trace plus one, 0 while the record is being written
+	uint32_t reg;
+	uint32_t value;       // raw register value
+	uint32_t rescaled;    // duty cycle in the hardware scale
+	uint16_t queueDepth;  // pending requests when recorded
+	TraceSource source;
+	uint8_t reserved[5];
+};
+
+static_assert(sizeof(SmootherTraceRecord) == 32, "Trace records are part of the dump format");
+
+/**
+ *  Trace dump header, followed by recordCount records oldest first
+ */
+struct SmootherTraceHeader {
+	uint32_t magic;        // TraceMagic
+	uint16_t version;      // TraceVersion
+	uint16_t recordSize;   // sizeof(SmootherTraceRecord)
+	uint32_t recordCount;
+	uint32_t lostCount;    // records overwritten or still being written at the dump
+};
+
+static_assert(sizeof(SmootherTraceHeader) == 16, "Trace header is part of the dump format");
+
+/**
+ *  Backlight register layouts for SmootherCore::wrapWriteRegister32.
+ *  DriverPacked:       the driver writes (frequency << 16) | duty into BXT_BLC_PWM_FREQ1
+ *  DriverDutyRegister: where the driver writes the duty cycle otherwise
+ *  HardwarePacked:     the hardware takes (frequency << 16) | duty in BXT_BLC_PWM_FREQ1
+ *  DutyRegister:       where the hardware takes the duty cycle
+ *  RestoresPwmControl: BXT_BLC_PWM_CTL1 writes must restore the firmware value
+ */
+struct IvyBacklightTraits {
+	static constexpr const char *Name = "Ivy";
+	static constexpr bool DriverPacked = false;
+	static constexpr uint32_t DriverDutyRegister = BLC_PWM_CPU_CTL;
+	static constexpr bool HardwarePacked = false;
+	static constexpr uint32_t DutyRegister = BLC_PWM_CPU_CTL;
+	static constexpr bool RestoresPwmControl = false;
+};
+
+struct HswBacklightTraits {
+	static constexpr const char *Name = "Hsw";
+	static constexpr bool DriverPacked = true;
+	static constexpr uint32_t DriverDutyRegister = BXT_BLC_PWM_FREQ1;
+	static constexpr bool HardwarePacked = true;
+	static constexpr uint32_t DutyRegister = BXT_BLC_PWM_FREQ1;
+	static constexpr bool RestoresPwmControl = false;
+};
+
+// Kaby Lake-R hardware driven by the Coffee Lake framebuffer
+struct KblFakeBacklightTraits {
+	static constexpr const char *Name = "KblFake";
+	static constexpr bool DriverPacked = false;
+	static constexpr uint32_t DriverDutyRegister = BXT_BLC_PWM_DUTY1;
+	static constexpr bool HardwarePacked = true;
+	static constexpr uint32_t DutyRegister = BXT_BLC_PWM_FREQ1;
+	static constexpr bool RestoresPwmControl = false;
+};
+
+struct CflRealBacklightTraits {
+	static constexpr const char *Name = "CflReal";
+	static constexpr bool DriverPacked = false;
+	static constexpr uint32_t DriverDutyRegister = BXT_BLC_PWM_DUTY1;
+	static constexpr bool HardwarePacked = false;
+	static constexpr uint32_t DutyRegister = BXT_BLC_PWM_DUTY1;
+	static constexpr bool RestoresPwmControl = false;
+};
+
+// Coffee Lake+ hardware driven by the Kaby Lake framebuffer
+struct CflFakeBacklightTraits {
+	static constexpr const char *Name = "CflFake";
+	static constexpr bool DriverPacked = true;
+	static constexpr uint32_t DriverDutyRegister = BXT_BLC_PWM_FREQ1;
+	static constexpr bool HardwarePacked = false;
+	static constexpr uint32_t DutyRegister = BXT_BLC_PWM_DUTY1;
+	static constexpr bool RestoresPwmControl = true;
+};
+
+/**
+ *  Original register functions of the framebuffer kext routed through one layout's translator
+ */
+struct BacklightAccessors {
+	/**
+	 *  Read a framebuffer controller register
+	 */
+	uint32_t (*readRegister32)(void *that, uint32_t reg);
+
+	/**
+	 *  Write a framebuffer controller register, bypassing the engine
+	 */
+	void (*writeRegister32)(void *that, uint32_t reg, uint32_t value);
+};
+
+/**
+ *  A WriteRegister32 replacement together with the register it writes duty cycles to
+ *  and the accessors the host fills in with the functions it replaced
+ */
+struct BacklightTranslator {
+	void (*wrapWriteRegister32)(void *that, uint32_t reg, uint32_t value);
+	uint32_t dutyRegister;
+	BacklightAccessors *accessors;
+};
+
+/**
+ *  Services the smoothing engine needs from its host.
+ *  In the kext these are backed by the framebuffer controller and the IOKit work loop.
+ */
+struct SmootherPlatform {
+	/**
+	 *  Arm the smoothing timer to call dischargeQueue after the given delay in microseconds.
+	 *  May be called from the WriteRegister32 path and from the timer itself.
+	 */
+	void (*scheduleTimer)(uint32_t us);
+
+	/**
+	 *  Monotonic clock in nanoseconds
+	 */
+	uint64_t (*currentTimeNs)();
+
+	/**
+	 *  Optional, have prepareControllers called soon on the thread running the timer.
+	 *  Without it tables are built inline on the first PWM frequency write.
+	 */
+	void (*schedulePrepare)();
+
+	/**
+	 *  Optional, called on every timer tick to have the statistics published.
+	 *  The host decides how often it actually takes a snapshot.
+	 */
+	void (*publishState)();
+};
+
+namespace SmootherCore {
+	static constexpr uint32_t FallbackTargetBacklightFrequency {120000};
+
+	static constexpr uint32_t START_VALUE = 5;
+	static constexpr uint32_t STEPS = 256;
+	static constexpr uint32_t DELAYMS = 7;
+	static constexpr uint32_t TIMER_LEEWAY_MS = 3;
+
+	// Spring time is omega * t in Q16. A critically damped spring starting at rest is within 1% of its target after 6.6.
+	static constexpr uint32_t SPRING_SETTLE = 432538;
+	static constexpr uint32_t LOG2E = 94548;  // log2(e) in Q16
+	static constexpr uint32_t DEFAULT_WRITE_BUDGET = 64;
+	static constexpr uint32_t MIN_WRITES = 4;
+
+	static constexpr uint32_t SHADOW_REGISTERS = 4;
+	static constexpr uint32_t MAX_CONTROLLERS = 4;
+	static constexpr uint32_t PLAN_CACHE_BITS = 5;
+	static constexpr uint32_t PLAN_CACHE_SIZE = 1U << PLAN_CACHE_BITS;
+
+	/**
+	 *  Duty cycles for the STEPS table positions, never decreasing
+	 */
+	struct DutyTable {
+		uint32_t quadraticFrequency;  // nonzero when values are quadraticDuty for this frequency, matches prebuilt tables
+		uint32_t values[STEPS];
+	};
+
+	/**
+	 *  Where a transition between two duty cycles starts on a duty table and how many entries it covers
+	 */
+	struct TransitionPlan {
+		uint32_t from;
+		uint32_t to;
+		uint32_t generation;  // tableGeneration the plan was computed for
+		int index;
+		int direction;
+		uint32_t span;
+	};
+
+	/**
+	 *  Smoothing state of one framebuffer controller, the that pointer WriteRegister32 is called with.
+	 *  Every controller has its own frequencies, duty table, request queue and transition.
+	 */
+	struct BacklightController {
+		void *that;    // nullptr until the slot is claimed and initialised
+		bool claimed;  // set by the thread that initialises the slot
+
+		// Taken from the translator that first saw the controller, each framebuffer kext routes through its own.
+		uint32_t dutyRegister;
+		const BacklightAccessors *accessors;
+
+		bool backlightValueAssigned;
+		uint32_t lastRequestedBacklightValue;
+		uint32_t currentBacklightValue;
+		uint32_t targetBacklightFrequency;
+		uint32_t targetPwmControl;
+		uint32_t driverBacklightFrequency;
+
+		// Published duty table, nullptr until generated. Tables are built in the generatedTables entry
+		// not currently published and swapped in with a single atomic store, so the timer never sees a partial table.
+		const DutyTable *dutyTable;
+		DutyTable generatedTables[2];
+
+		// Bumped by generateTables, invalidates planCache. Only the timer reads and writes planCache.
+		uint32_t tableGeneration;
+		TransitionPlan planCache[PLAN_CACHE_SIZE];
+
+		// Reciprocal used by rescaleDuty, tracks targetBacklightFrequency and the last divisor.
+		SmootherReciprocal dutyReciprocal;
+
+		// Shadow copies of the PWM registers as (1 << 32) | value, plus 1 << 33 when the plugin wrote the value, zero when unknown.
+		uint64_t shadowRegisters[SHADOW_REGISTERS];
+		bool shadowSuspended;
+
+		// Requests travel from WriteRegister32 (producer) to the smoothing timer (consumer) without locking.
+		AtomicQueue<BacklightRequest, 16> requestQueue;
+
+		// Newest request as (mask << 32) | value, used to recover from queue overflow.
+		uint64_t latestRequest;
+		bool requestDropped;
+
+		// The transition in progress, owned by the smoothing timer.
+		BacklightTransition transition;
+		bool transitionActive;
+		uint32_t transitionGeneration;  // tableGeneration the transition was planned on
+
+		// Firmware PWM capture and table generation requested from the host, see prepareControllers.
+		bool hardwarePacked;
+		bool prepareRequested;
+
+		// Driver writes that arrived before the firmware PWM frequency was known, as (reg << 32) | value, zero when none.
+		// prepareControllers replays them through deferredTranslator once it has read the frequency.
+		void (*deferredTranslator)(void *that, uint32_t reg, uint32_t value);
+		uint64_t deferredWrites[2];  // frequency, duty cycle
+
+		// Set on wake until the driver writes a nonzero duty cycle, which is then written without smoothing.
+		bool restorePending;
+
+		// Request filter state, see holdRequest and withinFilterDelta.
+		uint32_t forwardedValue;  // last target the timer accepted
+		uint64_t forwardTime;     // when the last request was handed to the timer
+		bool requestHeld;         // latestRequest is waiting for the hold window to end
+	};
+
+	extern SmootherPlatform platform;
+	extern SmootherConfiguration configuration;
+
+	extern BacklightController controllers[MAX_CONTROLLERS];
+
+	/**
+	 *  Original register functions behind the translator for each layout, set by the host when it routes WriteRegister32
+	 */
+	template <class Traits>
+	BacklightAccessors layoutAccessors {};
+
+	extern SmootherStatistics statistics;
+
+	static constexpr uint32_t TraceMagic = 0x54534241;  // 'ABST'
+	static constexpr uint16_t TraceVersion = 2;
+	static constexpr uint32_t TRACE_RECORDS = 1024;
+
+	extern bool traceEnabled;
+
+	/**
+	 *  Reset the engine state, the platform is left untouched
+	 */
+	void reset();
+
+	/**
+	 *  Check whether the platform is ready to run smooth transitions
+	 */
+	inline bool isSmoothingAvailable() {
+		return platform.scheduleTimer != nullptr;
+	}
+
+	/**
+	 *  Duty cycle of a table entry: DUTY = (frequency - START_VALUE) * (STEP / STEPS) ^ 2 + START_VALUE, rounded to nearest.
+	 *  Integer only, the result matches the former floating point generator bit for bit.
+	 */
+	constexpr uint32_t quadraticDuty(uint32_t frequency, uint32_t step) {
+		return static_cast<uint32_t>((static_cast<uint64_t>(frequency - START_VALUE) * step * step + STEPS * STEPS / 2) / (STEPS * STEPS)) + START_VALUE;
+	}
+
+	/**
+	 *  State of the controller a WriteRegister32 call is for, a free slot is claimed on first use
+	 *  with the duty register and accessors of the calling translator. nullptr for controllers beyond
+	 *  MAX_CONTROLLERS and while another thread is still claiming a slot, their writes are passed through.
+	 */
+	BacklightController *controllerFor(void *that, uint32_t dutyRegister = 0, const BacklightAccessors *accessors = nullptr);
+
+	/**
+	 *  Select the duty table for the controller's targetBacklightFrequency and the configured curve,
+	 *  computing it only when no prebuilt table matches
+	 */
+	void generateTables(BacklightController &controller);
+
+	/**
+	 *  Switch to new tunables at runtime and rebuild the duty tables of known controllers when the curve changed.
+	 *  Must run where the smoothing timer runs, returns false without changes while another update is in progress.
+	 *  pwmMax is left alone, the driver only programs the PWM frequency during modesets.
+	 */
+	bool applyConfiguration(const SmootherConfiguration &update);
+
+	/**
+	 *  First index in [from, to) whose entry is not less (lowerBound) or greater (upperBound) than value, to if none.
+	 *  Branchless, the loop only depends on the range size.
+	 */
+	int lowerBound(const uint32_t *data, int from, int to, uint32_t value);
+	int upperBound(const uint32_t *data, int from, int to, uint32_t value);
+
+	/**
+	 *  lowerBound/upperBound over a whole duty table
+	 */
+	int dutyLowerBound(const DutyTable &table, uint32_t value);
+	int dutyUpperBound(const DutyTable &table, uint32_t value);
+
+	/**
+	 *  Compute the reciprocal of divisor scaled by target
+	 */
+	SmootherReciprocal makeReciprocal(uint32_t target, uint32_t divisor);
+
+	/**
+	 *  Translate a duty cycle from the divisor scale to targetBacklightFrequency, divisor must be nonzero.
+	 *  The reciprocal is only recomputed when either frequency changes, so the usual case does not divide.
+	 */
+	uint32_t rescaleDuty(BacklightController &controller, uint32_t value, uint32_t divisor);
+
+	/**
+	 *  Read a PWM register, served from the shadow copy when the plugin knows its value
+	 */
+	uint32_t readRegister32(BacklightController &controller, uint32_t reg);
+
+	/**
+	 *  Write a register and remember the value of the PWM registers.
+	 *  Writes repeating the value the plugin last wrote to a PWM register are skipped unless forced.
+	 */
+	void writeRegister32(BacklightController &controller, uint32_t reg, uint32_t value, bool force = false);
+
+	/**
+	 *  Track the PWM frequency about to be written. Zero puts the panel to sleep and the hardware may lose
+	 *  its state, so the shadow copies are dropped and bypassed until a nonzero frequency is written again.
+	 */
+	void notePwmFrequency(BacklightController &controller, uint32_t frequency);
+
+	/**
+	 *  Forget the shadow copies, the next access of each PWM register goes to the hardware
+	 */
+	void dropShadowRegisters(BacklightController &controller);
+
+	/**
+	 *  Append a register write to the trace ring when tracing is enabled, never blocks
+	 */
+	void traceRegister(TraceSource source, BacklightController &controller, uint32_t reg, uint32_t value, uint32_t rescaled);
+
+	/**
+	 *  Bytes needed by dumpTrace
+	 */
+	size_t traceDumpSize();
+
+	/**
+	 *  Copy the trace into buffer as a SmootherTraceHeader and its records, returns the bytes written.
+	 *  Records a writer is still filling in or has overwritten meanwhile are left out and counted as lost.
+	 */
+	size_t dumpTrace(void *buffer, size_t size);
+
+	/**
+	 *  Queue a brightness request, called from WriteRegister32 and never blocks
+	 */
+	void pushQueue(BacklightController &controller, uint32_t value, uint32_t mask = 0);
+
+	/**
+	 *  Whether a request comes too soon after the last forwarded one, the timer then forwards it later. Never blocks.
+	 */
+	bool holdRequest(BacklightController &controller, uint64_t now);
+
+	/**
+	 *  Whether a request moves less than filterDelta table entries from the last applied target, called on the timer
+	 */
+	bool withinFilterDelta(BacklightController &controller, const DutyTable &table, uint32_t value);
+
+	/**
+	 *  Forward a held request once its hold window has ended, returns when to check again or 0
+	 */
+	uint64_t releaseHeldRequest(BacklightController &controller, uint64_t now);
+
+	/**
+	 *  Arm the smoothing timer delay ns from now and remember when it is due
+	 */
+	void armTimer(uint64_t now, uint64_t delay);
+
+	/**
+	 *  Point the controller's running transition at a new target, continuing from currentBacklightValue.
+	 *  In spring mode the motion in progress is kept and only its target moves.
+	 */
+	void retargetTransition(BacklightController &controller, uint32_t mask, uint32_t value, uint64_t timestamp);
+
+	/**
+	 *  Number of values to write for a transition covering span table entries,
+	 *  bounded by the write budget and by the timer ticks available in deadline mode
+	 */
+	uint32_t planTransitionSteps(uint32_t span);
+
+	/**
+	 *  Table position and span of a transition, from the controller's plan cache when the pair was seen
+	 *  since the tables were last generated. generation must be loaded before table.
+	 */
+	const TransitionPlan &transitionPlan(BacklightController &controller, const DutyTable &table, uint32_t generation, uint32_t from, uint32_t to);
+
+	/**
+	 *  Compute the value the controller's transition should show at the given time
+	 */
+	TransitionStep nextTransitionValue(BacklightController &controller, uint64_t now, uint32_t &value);
+
+	/**
+	 *  Duty table position of a duty cycle in 1/65536 entries, interpolating between entries, and back
+	 */
+	int64_t tablePosition(const DutyTable &table, uint32_t value);
+	uint32_t valueAtPosition(const DutyTable &table, int64_t position);
+
+	/**
+	 *  nextTransitionValue for spring mode: a critically damped spring moving the table position towards
+	 *  the target, settling within springMs of the last retarget
+	 */
+	TransitionStep nextSpringValue(BacklightController &controller, uint64_t now, uint32_t &value);
+
+	/**
+	 *  Apply the controller's queued requests and write the value due at now,
+	 *  returns when the controller needs the timer again or 0 once it is idle
+	 */
+	uint64_t dischargeController(BacklightController &controller, uint64_t now);
+
+	/**
+	 *  Advance every controller, called from the smoothing timer.
+	 *  The timer is only re-armed while a transition runs, for the earliest due controller,
+	 *  and fires up to TIMER_LEEWAY_MS late when that serves further controllers in the same tick.
+	 */
+	void dischargeQueue();
+
+	/**
+	 *  Read the PWM frequency set up by the firmware into targetBacklightFrequency unless it is already known
+	 */
+	void captureTargetFrequency(BacklightController &controller, bool packed, const char *name);
+
+	/**
+	 *  Drop the controller's queued requests and stop its transition, called from the timer's thread
+	 */
+	void cancelTransition(BacklightController &controller);
+
+	/**
+	 *  Power notifications, called on the thread running the timer. Transitions are cancelled at sleep
+	 *  and duty writes pass straight through until the driver restores the brightness after wake.
+	 */
+	void systemWillSleep();
+	void systemDidWake();
+
+	/**
+	 *  Whether a duty write must bypass smoothing because of sleep or wake, never blocks
+	 */
+	bool passThrough(BacklightController &controller, uint32_t value);
+
+	/**
+	 *  Ask the host to prepare a controller seen for the first time, never blocks
+	 */
+	void requestPrepare(BacklightController &controller, bool packed);
+
+	/**
+	 *  Leave a driver write to prepareControllers, returns false when the frequency became known meanwhile and the caller must apply it
+	 */
+	bool deferWrite(BacklightController &controller, size_t slot, void (*translator)(void *, uint32_t, uint32_t), uint32_t reg, uint32_t value);
+
+	/**
+	 *  Capture the firmware PWM frequency and build the duty tables of newly seen controllers.
+	 *  Runs on the host's work loop so none of this happens inside the driver's register writes,
+	 *  requests arriving before the tables are ready are merged and applied once they are.
+	 */
+	void prepareControllers();
+
+	/**
+	 *  WriteRegister32 replacement translating driver PWM writes for the hardware described by Traits,
+	 *  instantiated for the traits above
+	 */
+	template <class Traits>
+	void wrapWriteRegister32(void *that, uint32_t reg, uint32_t value);
+
+	/**
+	 *  Pick the translator and the duty register the engine writes to for a given layout
+	 */
+	template <class Traits>
+	constexpr BacklightTranslator makeTranslator() {
+		return {wrapWriteRegister32<Traits>, Traits::DutyRegister, &layoutAccessors<Traits>};
+	}
+}
+
+#endif /* kern_smoother_core_hpp */
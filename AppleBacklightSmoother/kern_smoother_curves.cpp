@@ -0,0 +1,147 @@
+//
+//  kern_smoother_curves.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "kern_smoother_curves.hpp"
+
+namespace SmootherCurves {
+	// 2 ^ (2 ^ -k) in Q30 for k = 1...16
+	static constexpr uint32_t exp2Fractions[] {
+		1518500250, 1276901417, 1170923762, 1121280436,
+		1097253708, 1085434106, 1079572136, 1076653033,
+		1075196443, 1074468888, 1074105294, 1073923544,
+		1073832680, 1073787251, 1073764537, 1073753181,
+	};
+
+	static inline uint32_t multiply(uint32_t a, uint32_t b) {
+		return static_cast<uint32_t>((static_cast<uint64_t>(a) * b) >> FRACTION_BITS);
+	}
+
+	static uint32_t evaluateQuadratic(uint32_t t, uint32_t) {
+		return multiply(t, t);
+	}
+
+	static uint32_t evaluateCubic(uint32_t t, uint32_t) {
+		return multiply(multiply(t, t), t);
+	}
+
+	// t ^ (parameter / 100)
+	static uint32_t evaluateGamma(uint32_t t, uint32_t parameter) {
+		if (t == 0) {
+			return 0;
+		}
+		int64_t exponent = static_cast<int64_t>(log2Fixed(t)) * parameter / 100;
+		if (exponent < -(static_cast<int64_t>(FRACTION_BITS + 2) << 16)) {
+			return 0;
+		}
+		return exp2Fixed(static_cast<int32_t>(exponent));
+	}
+
+	// (2 ^ (parameter * t) - 1) / (2 ^ parameter - 1)
+	static uint32_t evaluateExponential(uint32_t t, uint32_t parameter) {
+		if (parameter >= FRACTION_BITS) {
+			parameter = FRACTION_BITS - 1;
+		}
+		int64_t exponent = (static_cast<int64_t>(t) - ONE) * parameter >> (FRACTION_BITS - 16);
+		uint32_t scaled = exp2Fixed(static_cast<int32_t>(exponent));
+		uint32_t offset = ONE >> parameter;
+		if (scaled <= offset) {
+			return 0;
+		}
+		return static_cast<uint32_t>((static_cast<uint64_t>(scaled - offset) << FRACTION_BITS) / (ONE - offset));
+	}
+
+	// Relative luminance for a CIE L* lightness of 100 * t, so equal steps look equally large.
+	static uint32_t evaluatePerceptualLightness(uint32_t t, uint32_t) {
+		uint64_t lightness = static_cast<uint64_t>(t) * 100;
+		if (lightness <= 8ULL * ONE) {
+			return static_cast<uint32_t>(lightness * 27 / 24389);
+		}
+		uint32_t ratio = static_cast<uint32_t>((lightness + 16ULL * ONE) / 116);
+		return multiply(multiply(ratio, ratio), ratio);
+	}
+
+	static const SmootherCurveInfo curves[] {
+		{ "Quadratic", evaluateQuadratic, 0, 0, 0 },
+		{ "Cubic", evaluateCubic, 0, 0, 0 },
+		{ "Gamma", evaluateGamma, 220, 10, 1000 },
+		{ "Exponential", evaluateExponential, 8, 1, FRACTION_BITS - 1 },
+		{ "Perceptual Lightness", evaluatePerceptualLightness, 0, 0, 0 },
+	};
+}
+
+int32_t SmootherCurves::log2Fixed(uint32_t x) {
+	// Normalise into [1, 2), then square repeatedly to extract the fraction bits.
+	int32_t result = 0;
+	uint64_t y = x;
+	while (y < ONE) {
+		y <<= 1;
+		result -= 1 << 16;
+	}
+	while (y >= 2ULL * ONE) {
+		y >>= 1;
+		result += 1 << 16;
+	}
+	for (int bit = 15; bit >= 0; bit--) {
+		y = (y * y) >> FRACTION_BITS;
+		if (y >= 2ULL * ONE) {
+			y >>= 1;
+			result += 1 << bit;
+		}
+	}
+	return result;
+}
+
+uint32_t SmootherCurves::exp2Fixed(int32_t value) {
+	if (value > 0) {
+		value = 0;
+	}
+	// value = -whole + fraction with fraction in [0, 1)
+	uint32_t whole = static_cast<uint32_t>(-(value >> 16));
+	uint32_t fraction = static_cast<uint32_t>(value) & 0xffffU;
+	if (whole > FRACTION_BITS + 1) {
+		return 0;
+	}
+	uint64_t result = 1ULL << 30;
+	for (uint32_t k = 0; k < 16; k++) {
+		if (fraction & (0x8000U >> k)) {
+			result = (result * exp2Fractions[k]) >> 30;
+		}
+	}
+	return static_cast<uint32_t>((result >> (30 - FRACTION_BITS)) >> whole);
+}
+
+const SmootherCurveInfo &SmootherCurves::info(SmootherCurve curve) {
+	auto index = static_cast<uint32_t>(curve);
+	return index < arrsize(curves) ? curves[index] : curves[0];
+}
+
+bool SmootherCurves::isValid(SmootherCurve curve, uint32_t parameter) {
+	auto index = static_cast<uint32_t>(curve);
+	if (index >= arrsize(curves)) {
+		return false;
+	}
+	return parameter == 0 || (parameter >= curves[index].minParameter && parameter <= curves[index].maxParameter);
+}
+
+void SmootherCurves::fillTable(uint32_t *table, uint32_t steps, uint32_t frequency, SmootherCurve curve, uint32_t parameter) {
+	auto &policy = info(curve);
+	if (parameter == 0) {
+		parameter = policy.defaultParameter;
+	}
+
+	uint64_t range = frequency - SmootherCore::START_VALUE;
+	uint32_t previous = 0;
+	for (uint32_t i = 0; i < steps; i++) {
+		uint32_t t = static_cast<uint32_t>((static_cast<uint64_t>(i) << FRACTION_BITS) / steps);
+		uint32_t duty = static_cast<uint32_t>((range * policy.evaluate(t, parameter) + ONE / 2) >> FRACTION_BITS) + SmootherCore::START_VALUE;
+		// Fixed point rounding must not break the ordering the table lookups rely on.
+		if (duty < previous) {
+			duty = previous;
+		}
+		table[i] = previous = duty;
+	}
+}
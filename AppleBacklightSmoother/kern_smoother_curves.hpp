@@ -0,0 +1,55 @@
+//
+//  kern_smoother_curves.hpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#ifndef kern_smoother_curves_hpp
+#define kern_smoother_curves_hpp
+
+#include "kern_smoother_core.hpp"
+
+/**
+ *  Easing curve policy: maps a table position to a brightness fraction.
+ *  Both are Q24 fixed point values in [0, SmootherCurves::ONE].
+ */
+struct SmootherCurveInfo {
+	const char *name;
+	uint32_t (*evaluate)(uint32_t t, uint32_t parameter);
+	uint32_t defaultParameter;
+	uint32_t minParameter;  // accepted parameter range, curves without a parameter only take 0
+	uint32_t maxParameter;
+};
+
+namespace SmootherCurves {
+	static constexpr uint32_t FRACTION_BITS = 24;
+	static constexpr uint32_t ONE = 1U << FRACTION_BITS;
+
+	/**
+	 *  log2(x / ONE) in Q16, x must be nonzero
+	 */
+	int32_t log2Fixed(uint32_t x);
+
+	/**
+	 *  2 ^ (value / 65536) in Q24, value must not be positive
+	 */
+	uint32_t exp2Fixed(int32_t value);
+
+	/**
+	 *  Curve description, falls back to the quadratic curve for unknown values
+	 */
+	const SmootherCurveInfo &info(SmootherCurve curve);
+
+	/**
+	 *  Whether the curve exists and takes the parameter, 0 always selects the default
+	 */
+	bool isValid(SmootherCurve curve, uint32_t parameter);
+
+	/**
+	 *  Fill a duty table of the given size for a PWM maximum, entries never decrease
+	 */
+	void fillTable(uint32_t *table, uint32_t steps, uint32_t frequency, SmootherCurve curve, uint32_t parameter);
+}
+
+#endif /* kern_smoother_curves_hpp */
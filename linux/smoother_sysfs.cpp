@@ -0,0 +1,196 @@
+//
+//  smoother_sysfs.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "smoother_sysfs.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace SmootherSysfs {
+	// Attribute values are short decimal numbers followed by a newline.
+	static constexpr size_t ATTRIBUTE_SIZE = 16;
+
+	static bool parseNumber(const char *text, uint32_t &value, const char **end) {
+		while (*text == ' ' || *text == '\t' || *text == '\n') {
+			text++;
+		}
+		if (*text < '0' || *text > '9') {
+			return false;
+		}
+		errno = 0;
+		char *last;
+		unsigned long number = strtoul(text, &last, 10);
+		if (errno || number > UINT32_MAX) {
+			return false;
+		}
+		value = static_cast<uint32_t>(number);
+		*end = last;
+		return true;
+	}
+
+	static bool readNumber(int fd, uint32_t &value) {
+		char buffer[ATTRIBUTE_SIZE];
+		ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+		if (size <= 0) {
+			return false;
+		}
+		buffer[size] = '\0';
+		const char *end;
+		return parseNumber(buffer, value, &end);
+	}
+
+	static bool readAttribute(const char *directory, const char *name, uint32_t &value) {
+		char path[PATH_MAX];
+		if (snprintf(path, sizeof(path), "%s/%s", directory, name) >= static_cast<int>(sizeof(path))) {
+			return false;
+		}
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		bool valid = readNumber(fd, value);
+		close(fd);
+		return valid;
+	}
+
+	static uint32_t readRegister32(void *that, uint32_t reg) {
+		auto &device = *static_cast<Device *>(that);
+		uint32_t value = 0;
+		if (reg == BXT_BLC_PWM_FREQ1) {
+			value = device.maxBrightness;
+		} else if (reg == BXT_BLC_PWM_DUTY1 && !readBrightness(device, value)) {
+			value = 0;
+		}
+		return value;
+	}
+
+	static void writeRegister32(void *that, uint32_t reg, uint32_t value) {
+		// The frequency is max_brightness and never changes, only the brightness is written.
+		if (reg != BXT_BLC_PWM_DUTY1) {
+			return;
+		}
+
+		auto &device = *static_cast<Device *>(that);
+		char buffer[ATTRIBUTE_SIZE];
+		int size = snprintf(buffer, sizeof(buffer), "%u\n", value);
+		device.writes++;
+		if (pwrite(device.brightness, buffer, static_cast<size_t>(size), 0) != size) {
+			// Report the first failure only, the timer would flood the log otherwise.
+			if (device.failedWrites++ == 0) {
+				SYSLOG("sysfs", "writeRegister32: cannot write brightness %u (%s)", value, strerror(errno));
+			}
+		}
+	}
+}
+
+bool SmootherSysfs::findDevice(char *path, size_t size, const char *directory) {
+	DIR *dir = opendir(directory);
+	if (!dir) {
+		return false;
+	}
+
+	// Take the first name in order, readdir order is arbitrary.
+	char first[NAME_MAX + 1] = {};
+	while (auto entry = readdir(dir)) {
+		if (entry->d_name[0] != '.' && (!first[0] || strcmp(entry->d_name, first) < 0)) {
+			snprintf(first, sizeof(first), "%s", entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	return first[0] && snprintf(path, size, "%s/%s", directory, first) < static_cast<int>(size);
+}
+
+bool SmootherSysfs::openDevice(Device &device, const char *directory) {
+	uint32_t maxBrightness;
+	if (!readAttribute(directory, "max_brightness", maxBrightness)) {
+		SYSLOG("sysfs", "openDevice: cannot read %s/max_brightness", directory);
+		return false;
+	}
+	// The duty tables start at START_VALUE, there is nothing to smooth below it.
+	if (maxBrightness <= SmootherCore::START_VALUE) {
+		SYSLOG("sysfs", "openDevice: max_brightness %u of %s is too small", maxBrightness, directory);
+		return false;
+	}
+
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/brightness", directory) >= static_cast<int>(sizeof(path))) {
+		return false;
+	}
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		SYSLOG("sysfs", "openDevice: cannot open %s (%s)", path, strerror(errno));
+		return false;
+	}
+
+	device.brightness = fd;
+	device.maxBrightness = maxBrightness;
+	device.writes = 0;
+	device.failedWrites = 0;
+	DBGLOG("sysfs", "openDevice: %s, max_brightness = %u", directory, maxBrightness);
+	return true;
+}
+
+void SmootherSysfs::closeDevice(Device &device) {
+	if (device.brightness >= 0) {
+		close(device.brightness);
+		device.brightness = -1;
+	}
+}
+
+bool SmootherSysfs::readBrightness(Device &device, uint32_t &value) {
+	return readNumber(device.brightness, value);
+}
+
+void SmootherSysfs::install() {
+	SmootherCore::layoutAccessors<Traits> = {readRegister32, writeRegister32};
+}
+
+void SmootherSysfs::attach(Device &device) {
+	uint32_t current = 0;
+	if (!readBrightness(device, current)) {
+		SYSLOG("sysfs", "attach: cannot read brightness, starting from 0");
+	}
+
+	// With the driver scale equal to max_brightness duty cycles go through unscaled.
+	SmootherCore::wrapWriteRegister32<Traits>(&device, BXT_BLC_PWM_FREQ1, device.maxBrightness);
+	SmootherCore::wrapWriteRegister32<Traits>(&device, BXT_BLC_PWM_DUTY1, current < device.maxBrightness ? current : device.maxBrightness);
+}
+
+void SmootherSysfs::request(Device &device, uint32_t value) {
+	SmootherCore::wrapWriteRegister32<Traits>(&device, BXT_BLC_PWM_DUTY1, value < device.maxBrightness ? value : device.maxBrightness);
+}
+
+bool SmootherSysfs::parseRequest(const char *text, uint32_t maxBrightness, uint32_t &value) {
+	const char *end;
+	uint32_t number;
+	if (!parseNumber(text, number, &end)) {
+		return false;
+	}
+
+	bool percent = *end == '%';
+	if (percent) {
+		end++;
+	}
+	while (*end == ' ' || *end == '\t' || *end == '\n') {
+		end++;
+	}
+	if (*end != '\0' || (percent && number > 100)) {
+		return false;
+	}
+
+	if (percent) {
+		number = static_cast<uint32_t>((static_cast<uint64_t>(number) * maxBrightness + 50) / 100);
+	}
+	value = number < maxBrightness ? number : maxBrightness;
+	return true;
+}
@@ -0,0 +1,80 @@
+//
+//  smoother_sysfs.hpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#ifndef smoother_sysfs_hpp
+#define smoother_sysfs_hpp
+
+#include "kern_smoother_core.hpp"
+
+/**
+ *  Linux backlight class backend for the smoothing engine.
+ *  The attributes of /sys/class/backlight/<device> stand in for the CFL registers:
+ *  max_brightness reads as BXT_BLC_PWM_FREQ1 and brightness as BXT_BLC_PWM_DUTY1.
+ */
+namespace SmootherSysfs {
+	/**
+	 *  Register layout the requests go through, the driver and the hardware scale are both max_brightness
+	 */
+	using Traits = CflRealBacklightTraits;
+
+	/**
+	 *  Default directory searched by findDevice
+	 */
+	static constexpr const char *BacklightClass = "/sys/class/backlight";
+
+	/**
+	 *  An opened backlight device, its address is the that pointer handed to the engine
+	 */
+	struct Device {
+		int brightness {-1};         // brightness attribute, open for reading and writing
+		uint32_t maxBrightness {0};  // max_brightness attribute, read once
+		uint32_t writes {0};         // brightness writes issued
+		uint32_t failedWrites {0};   // brightness writes the kernel rejected
+	};
+
+	/**
+	 *  Path of the first device under the backlight class directory, returns false when there is none
+	 */
+	bool findDevice(char *path, size_t size, const char *directory = BacklightClass);
+
+	/**
+	 *  Open the brightness attribute and read max_brightness of a device directory
+	 */
+	bool openDevice(Device &device, const char *directory);
+
+	/**
+	 *  Close a device opened by openDevice
+	 */
+	void closeDevice(Device &device);
+
+	/**
+	 *  Read the brightness attribute, returns false when it is unreadable
+	 */
+	bool readBrightness(Device &device, uint32_t &value);
+
+	/**
+	 *  Route the engine's register functions for Traits to the sysfs attributes
+	 */
+	void install();
+
+	/**
+	 *  Hand a device to the engine at its current brightness, like the driver's power on writes
+	 */
+	void attach(Device &device);
+
+	/**
+	 *  Fade to a brightness in max_brightness units, larger values are clamped
+	 */
+	void request(Device &device, uint32_t value);
+
+	/**
+	 *  Parse a request as brightness units or as a percentage with a trailing %, surrounding whitespace is ignored
+	 */
+	bool parseRequest(const char *text, uint32_t maxBrightness, uint32_t &value);
+}
+
+#endif /* smoother_sysfs_hpp */
@@ -0,0 +1,275 @@
+//
+//  smootherd.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "smoother_sysfs.hpp"
+#include "kern_smoother_curves.hpp"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Smooth brightness changes of a Linux backlight class device with the kext's engine.
+// Requests are written to a control file, in max_brightness units or as a percentage:
+//
+//   echo 50% > /run/backlight-smoother/brightness
+//
+// The smoothing timer is a timerfd, both are served from one poll loop.
+//
+//   smootherd [-d device] [-c control] [-C curve] [-P parameter] [-D ms] [-W writes] [-T ms] [-S ms] [-F steps] [-H ms]
+
+namespace {
+	static constexpr const char *DefaultControl = "/run/backlight-smoother/brightness";
+
+	struct Options {
+		const char *device {nullptr};
+		const char *control {DefaultControl};
+	};
+
+	static int timerFd = -1;
+	static volatile sig_atomic_t stopRequested;
+
+	static void scheduleTimer(uint32_t us) {
+		// A zero it_value disarms the timer, round up to the next nanosecond instead.
+		itimerspec spec {};
+		spec.it_value.tv_sec = us / 1000000;
+		spec.it_value.tv_nsec = us ? (us % 1000000) * 1000L : 1;
+		if (timerfd_settime(timerFd, 0, &spec, nullptr) != 0) {
+			SYSLOG("smootherd", "scheduleTimer: cannot arm the timer (%s)", strerror(errno));
+		}
+	}
+
+	static uint64_t currentTimeNs() {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+	}
+
+	static void stop(int) {
+		stopRequested = 1;
+	}
+
+	static bool parseValue(const char *text, uint32_t &value) {
+		char *end;
+		errno = 0;
+		unsigned long number = strtoul(text, &end, 0);
+		if (errno || *text == '\0' || *end != '\0' || number > UINT32_MAX) {
+			return false;
+		}
+		value = static_cast<uint32_t>(number);
+		return true;
+	}
+
+	// The options take the same values as the boot arguments of the kext.
+	static bool parse(int argc, char **argv, Options &options) {
+		auto &configuration = SmootherCore::configuration;
+		int option;
+		while ((option = getopt(argc, argv, "d:c:C:P:D:W:T:S:F:H:")) != -1) {
+			uint32_t value = 0;
+			if (option != 'd' && option != 'c' && (option == '?' || !parseValue(optarg, value))) {
+				return false;
+			}
+			switch (option) {
+				case 'd':
+					options.device = optarg;
+					break;
+				case 'c':
+					options.control = optarg;
+					break;
+				case 'C':
+					configuration.curve = static_cast<SmootherCurve>(value);
+					break;
+				case 'P':
+					configuration.curveParameter = value;
+					break;
+				case 'D':
+					configuration.durationMs = value;
+					break;
+				case 'W':
+					configuration.writeBudget = value;
+					break;
+				case 'T':
+					configuration.tickMs = value ? value : SmootherCore::DELAYMS;
+					break;
+				case 'S':
+					configuration.springMs = value;
+					break;
+				case 'F':
+					configuration.filterDelta = value;
+					break;
+				case 'H':
+					configuration.filterHoldMs = value;
+					break;
+				default:
+					return false;
+			}
+		}
+		if (optind != argc) {
+			return false;
+		}
+		if (!SmootherCurves::isValid(configuration.curve, configuration.curveParameter)) {
+			fprintf(stderr, "smootherd: curve %u does not take parameter %u\n", static_cast<uint32_t>(configuration.curve), configuration.curveParameter);
+			return false;
+		}
+		return true;
+	}
+
+	// Directory holding the control file, returns the file name within it.
+	static const char *controlDirectory(const char *control, char *directory, size_t size) {
+		const char *slash = strrchr(control, '/');
+		if (!slash) {
+			snprintf(directory, size, ".");
+			return control;
+		}
+		// Keep the root directory as "/".
+		int length = slash == control ? 1 : static_cast<int>(slash - control);
+		snprintf(directory, size, "%.*s", length, control);
+		return slash + 1;
+	}
+
+	// Create the control file holding the current brightness, the directory is created when missing.
+	static bool createControl(const char *control, uint32_t brightness) {
+		char directory[PATH_MAX];
+		controlDirectory(control, directory, sizeof(directory));
+		if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+			fprintf(stderr, "smootherd: cannot create %s (%s)\n", directory, strerror(errno));
+			return false;
+		}
+
+		FILE *file = fopen(control, "w");
+		if (!file) {
+			fprintf(stderr, "smootherd: cannot create %s (%s)\n", control, strerror(errno));
+			return false;
+		}
+		fprintf(file, "%u\n", brightness);
+		fclose(file);
+		return true;
+	}
+
+	static void readControl(SmootherSysfs::Device &device, const char *control) {
+		FILE *file = fopen(control, "r");
+		if (!file) {
+			return;
+		}
+		char text[32];
+		uint32_t value;
+		if (fgets(text, sizeof(text), file) && SmootherSysfs::parseRequest(text, device.maxBrightness, value)) {
+			SmootherSysfs::request(device, value);
+		} else {
+			SYSLOG("smootherd", "readControl: ignoring malformed request in %s", control);
+		}
+		fclose(file);
+	}
+
+	// Serve timer expirations and control file updates until a signal asks to stop.
+	static int run(SmootherSysfs::Device &device, const char *control) {
+		char directory[PATH_MAX];
+		const char *name = controlDirectory(control, directory, sizeof(directory));
+
+		// Editors replace the file instead of writing it, so the directory is watched.
+		int notifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		if (notifyFd < 0 || inotify_add_watch(notifyFd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			fprintf(stderr, "smootherd: cannot watch %s (%s)\n", directory, strerror(errno));
+			return 1;
+		}
+
+		pollfd fds[] {{timerFd, POLLIN, 0}, {notifyFd, POLLIN, 0}};
+		while (!stopRequested) {
+			if (poll(fds, arrsize(fds), -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				fprintf(stderr, "smootherd: poll failed (%s)\n", strerror(errno));
+				break;
+			}
+
+			if (fds[0].revents & POLLIN) {
+				uint64_t expirations;
+				if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					SmootherCore::dischargeQueue();
+				}
+			}
+
+			if (fds[1].revents & POLLIN) {
+				alignas(inotify_event) char buffer[4096];
+				bool changed = false;
+				ssize_t size;
+				while ((size = read(notifyFd, buffer, sizeof(buffer))) > 0) {
+					for (char *next = buffer; next < buffer + size;) {
+						auto event = reinterpret_cast<inotify_event *>(next);
+						changed |= event->len && !strcmp(event->name, name);
+						next += sizeof(inotify_event) + event->len;
+					}
+				}
+				// Only the newest request matters, several writes since the last poll are read once.
+				if (changed) {
+					readControl(device, control);
+				}
+			}
+		}
+
+		close(notifyFd);
+		return 0;
+	}
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	if (!parse(argc, argv, options)) {
+		fprintf(stderr, "usage: %s [-d device] [-c control] [-C curve] [-P parameter] [-D ms] [-W writes] [-T ms] [-S ms] [-F steps] [-H ms]\n", argv[0]);
+		return 2;
+	}
+
+	char found[PATH_MAX];
+	if (!options.device) {
+		if (!SmootherSysfs::findDevice(found, sizeof(found))) {
+			fprintf(stderr, "smootherd: no device in %s\n", SmootherSysfs::BacklightClass);
+			return 1;
+		}
+		options.device = found;
+	}
+
+	SmootherSysfs::Device device;
+	if (!SmootherSysfs::openDevice(device, options.device)) {
+		return 1;
+	}
+
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timerFd < 0) {
+		fprintf(stderr, "smootherd: cannot create the timer (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	uint32_t brightness = 0;
+	SmootherSysfs::readBrightness(device, brightness);
+	if (!createControl(options.control, brightness)) {
+		return 1;
+	}
+
+	struct sigaction action {};
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	SmootherCore::platform = {scheduleTimer, currentTimeNs, nullptr, nullptr};
+	SmootherSysfs::install();
+	SmootherSysfs::attach(device);
+	printf("smootherd: %s, max_brightness %u, requests in %s\n", options.device, device.maxBrightness, options.control);
+	fflush(stdout);
+
+	int status = run(device, options.control);
+	close(timerFd);
+	SmootherSysfs::closeDevice(device);
+	return status;
+}
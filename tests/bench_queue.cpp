@@ -0,0 +1,121 @@
+//
+//  bench_queue.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "kern_smoother_core.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Push latency on the driver thread while a timer thread keeps draining, printed as CSV.
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr auto RUN_TIME = std::chrono::seconds(1);
+
+	// The request queue and lock the engine used before AtomicQueue, pushes and drains hold the lock throughout.
+	template <class T, unsigned N>
+	class LockedQueue {
+	private:
+		T m_buffer[N];
+		unsigned m_head {0}, m_tail {0};
+		std::recursive_mutex m_lock;
+
+	public:
+		bool push(const T &data) {
+			std::lock_guard<std::recursive_mutex> guard(m_lock);
+			unsigned new_head = m_head + 1;
+			if (new_head >= N) new_head = 0;
+			if (new_head == m_tail) {
+				return false;
+			}
+			m_buffer[m_head] = data;
+			m_head = new_head;
+			return true;
+		}
+
+		template <class F>
+		void drain(F consume) {
+			std::lock_guard<std::recursive_mutex> guard(m_lock);
+			while (m_head != m_tail) {
+				consume(m_buffer[m_tail++]);
+				if (m_tail >= N) m_tail = 0;
+			}
+		}
+	};
+
+	template <class T, unsigned N>
+	class LockFreeQueue {
+	private:
+		AtomicQueue<T, N> m_queue;
+
+	public:
+		bool push(const T &data) {
+			return m_queue.push(data);
+		}
+
+		template <class F>
+		void drain(F consume) {
+			T data;
+			while (m_queue.fetch(data)) {
+				consume(data);
+			}
+		}
+	};
+
+	static volatile uint32_t registerSink;
+
+	// Stand-in for the register write the timer does per request.
+	static void registerWrite(const BacklightRequest &request) {
+		for (int i = 0; i < 64; i++) {
+			registerSink = request.value + i;
+		}
+	}
+
+	template <class Queue>
+	static void run(const char *name) {
+		static Queue queue;
+		std::atomic<bool> stop {false};
+		std::thread timer([&stop] {
+			while (!stop) {
+				queue.drain(registerWrite);
+				std::this_thread::yield();
+			}
+		});
+
+		std::vector<uint64_t> latencies;
+		uint32_t rejected = 0;
+		auto end = Clock::now() + RUN_TIME;
+		for (uint32_t i = 0; Clock::now() < end; i++) {
+			auto start = Clock::now();
+			bool pushed = queue.push(BacklightRequest(0, i, 0));
+			latencies.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+			rejected += !pushed;
+		}
+		stop = true;
+		timer.join();
+
+		std::sort(latencies.begin(), latencies.end());
+		uint64_t total = 0;
+		for (auto latency : latencies) {
+			total += latency;
+		}
+		printf("push_contended,%s,%zu,%u,%.1f,%llu,%llu\n", name, latencies.size(), rejected, static_cast<double>(total) / latencies.size(),
+			   static_cast<unsigned long long>(latencies[latencies.size() * 99 / 100]), static_cast<unsigned long long>(latencies.back()));
+	}
+}
+
+int main() {
+	printf("benchmark,queue,pushes,rejected,mean_ns,p99_ns,max_ns\n");
+	run<LockedQueue<BacklightRequest, 16>>("locked");
+	run<LockFreeQueue<BacklightRequest, 16>>("atomic");
+	return 0;
+}
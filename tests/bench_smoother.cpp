@@ -0,0 +1,255 @@
+//
+//  bench_smoother.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+#include "kern_smoother_curves.hpp"
+
+#include <chrono>
+
+// Hot path timings for several PWM maxima, printed as CSV to compare against a stored baseline.
+// Register accesses go to a null sink, the smoothing timer runs on the virtual clock.
+
+using namespace SmootherHarness;
+using SmootherCore::STEPS;
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr uint32_t pwmMaxima[] {0x56C, 0x7A1, 0xFFFF, SmootherCore::FallbackTargetBacklightFrequency};
+	static constexpr auto MIN_TIME = std::chrono::milliseconds(100);
+
+	static volatile uint32_t sink;
+	static uint32_t registerWrites;
+
+	static uint32_t readRegister32(void *, uint32_t reg) {
+		// Nonzero frequency in both register layouts, configuration.pwmMax decides the real one.
+		return reg == BXT_BLC_PWM_FREQ1 ? 0x10001000 : 0;
+	}
+
+	static void writeRegister32(void *, uint32_t, uint32_t value) {
+		sink = value;
+		registerWrites++;
+	}
+
+	static void report(const char *name, uint32_t pwm, uint64_t iterations, double nanoseconds, double writes) {
+		printf("%s,%u,%llu,%.2f,%.2f\n", name, pwm, static_cast<unsigned long long>(iterations), nanoseconds / iterations, writes / iterations);
+	}
+
+	// Run batches of the operation until MIN_TIME has passed, untimed work between batches is left to the operation.
+	template <class F>
+	static void measure(const char *name, uint32_t pwm, uint32_t batch, F operation) {
+		uint64_t iterations = 0;
+		double elapsed = 0;
+		uint32_t writes = registerWrites;
+		while (elapsed < std::chrono::duration<double, std::nano>(MIN_TIME).count()) {
+			elapsed += operation(batch);
+			iterations += batch;
+		}
+		report(name, pwm, iterations, elapsed, registerWrites - writes);
+	}
+
+	template <class F>
+	static double timed(F body) {
+		auto start = Clock::now();
+		body();
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	}
+
+	static void resetEngine(uint32_t pwm) {
+		reset();
+		SmootherCore::layoutAccessors<IvyBacklightTraits> = {readRegister32, writeRegister32};
+		SmootherCore::layoutAccessors<HswBacklightTraits> = {readRegister32, writeRegister32};
+		SmootherCore::layoutAccessors<KblFakeBacklightTraits> = {readRegister32, writeRegister32};
+		SmootherCore::layoutAccessors<CflRealBacklightTraits> = {readRegister32, writeRegister32};
+		SmootherCore::layoutAccessors<CflFakeBacklightTraits> = {readRegister32, writeRegister32};
+		SmootherCore::configuration.pwmMax = pwm;
+	}
+
+	static int that;
+
+	static SmootherCore::BacklightController &readyController(uint32_t pwm) {
+		resetEngine(pwm);
+		auto write = SmootherCore::wrapWriteRegister32<CflRealBacklightTraits>;
+		write(&that, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write(&that, BXT_BLC_PWM_DUTY1, 0x8000);
+		return *SmootherCore::controllerFor(&that);
+	}
+
+	// Values spread over the whole range in a fixed pseudo random order.
+	static uint32_t spread(uint32_t i, uint32_t range) {
+		return static_cast<uint32_t>((static_cast<uint64_t>(i * 2654435761U) * range) >> 32);
+	}
+
+	static int legacyLowerBound(const uint32_t *data, int from, int to, uint32_t value) {
+		int result = to--, mid;
+		while (from <= to) {
+			mid = (from + to) >> 1;
+			if (data[mid] >= value) {
+				result = mid;
+				to = mid - 1;
+			} else {
+				from = mid + 1;
+			}
+		}
+		return result;
+	}
+
+	static void benchTables(uint32_t pwm) {
+		auto &controller = readyController(pwm);
+		measure("generate_tables", pwm, 64, [&controller](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					SmootherCore::generateTables(controller);
+				}
+			});
+		});
+
+		uint32_t values[STEPS];
+		measure("fill_quadratic", pwm, 64, [&values, pwm](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					for (uint32_t step = 0; step < STEPS; step++) {
+						values[step] = SmootherCore::quadraticDuty(pwm + (i & 1), step);
+					}
+					sink = values[i & (STEPS - 1)];
+				}
+			});
+		});
+		measure("fill_gamma", pwm, 16, [&values, pwm](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					SmootherCurves::fillTable(values, STEPS, pwm, SmootherCurve::Gamma, 0);
+					sink = values[i & (STEPS - 1)];
+				}
+			});
+		});
+	}
+
+	static void benchLookups(uint32_t pwm) {
+		auto &table = *readyController(pwm).dutyTable;
+		measure("lookup_legacy", pwm, 4096, [&table, pwm](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					sink = legacyLowerBound(table.values, 0, STEPS, spread(i, pwm));
+				}
+			});
+		});
+		measure("lookup_branchless", pwm, 4096, [&table, pwm](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					sink = SmootherCore::lowerBound(table.values, 0, STEPS, spread(i, pwm));
+				}
+			});
+		});
+		measure("lookup_upper_branchless", pwm, 4096, [&table, pwm](uint32_t batch) {
+			return timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					sink = SmootherCore::upperBound(table.values, 0, STEPS, spread(i, pwm));
+				}
+			});
+		});
+	}
+
+	// Driver side cost of queueing a request, the timer drains untimed between batches.
+	static void benchPush(uint32_t pwm) {
+		auto &controller = readyController(pwm);
+		uint32_t counter = 0;
+		measure("push_queue", pwm, 8, [&controller, &counter, pwm](uint32_t batch) {
+			double elapsed = timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					SmootherCore::pushQueue(controller, spread(++counter, pwm), 0);
+				}
+			});
+			runUntilIdle();
+			return elapsed;
+		});
+	}
+
+	// Whole transitions: the request and every timer tick until the target is written.
+	static void benchTransitions(uint32_t pwm) {
+		auto &controller = readyController(pwm);
+		uint32_t middle = pwm / 2, counter = 0;
+		measure("transition_short", pwm, 1, [&controller, &counter, middle, pwm](uint32_t) {
+			return timed([&] {
+				SmootherCore::pushQueue(controller, middle + (++counter & 1 ? pwm / 64 : 0), 0);
+				runUntilIdle();
+			});
+		});
+		measure("transition_long", pwm, 1, [&controller, &counter, pwm](uint32_t) {
+			return timed([&] {
+				SmootherCore::pushQueue(controller, ++counter & 1 ? pwm : SmootherCore::START_VALUE, 0);
+				runUntilIdle();
+			});
+		});
+		measure("transition_reversing", pwm, 1, [&controller, &counter, pwm](uint32_t) {
+			return timed([&] {
+				bool up = ++counter & 1;
+				SmootherCore::pushQueue(controller, up ? pwm : SmootherCore::START_VALUE, 0);
+				for (int tick = 0; tick < 8; tick++) {
+					fire();
+				}
+				SmootherCore::pushQueue(controller, up ? SmootherCore::START_VALUE : pwm, 0);
+				runUntilIdle();
+			});
+		});
+
+		// One timer tick taking over a full queue of superseded requests.
+		measure("discharge_full_queue", pwm, 1, [&controller, &counter, pwm](uint32_t) {
+			for (uint32_t i = 0; i < 16; i++) {
+				SmootherCore::pushQueue(controller, spread(++counter, pwm), 0);
+			}
+			double elapsed = timed([] {
+				fire();
+			});
+			runUntilIdle();
+			return elapsed;
+		});
+	}
+
+	template <class Traits>
+	static void benchTranslator(const char *name, uint32_t pwm) {
+		resetEngine(pwm);
+		if (Traits::DriverPacked) {
+			SmootherCore::wrapWriteRegister32<Traits>(&that, BXT_BLC_PWM_FREQ1, 0xFFFF8000);
+		} else {
+			SmootherCore::wrapWriteRegister32<Traits>(&that, BXT_BLC_PWM_FREQ1, 0xFFFF);
+			SmootherCore::wrapWriteRegister32<Traits>(&that, Traits::DriverDutyRegister, 0x8000);
+		}
+
+		uint32_t counter = 0;
+		measure(name, pwm, 8, [&counter](uint32_t batch) {
+			double elapsed = timed([&] {
+				for (uint32_t i = 0; i < batch; i++) {
+					uint32_t duty = spread(++counter, 0x10000);
+					if (Traits::DriverPacked) {
+						SmootherCore::wrapWriteRegister32<Traits>(&that, BXT_BLC_PWM_FREQ1, 0xFFFF0000U | duty);
+					} else {
+						SmootherCore::wrapWriteRegister32<Traits>(&that, Traits::DriverDutyRegister, duty);
+					}
+				}
+			});
+			runUntilIdle();
+			return elapsed;
+		});
+	}
+}
+
+int main() {
+	printf("benchmark,pwm,iterations,ns_per_op,writes_per_op\n");
+	for (auto pwm : pwmMaxima) {
+		benchTables(pwm);
+		benchLookups(pwm);
+		benchPush(pwm);
+		benchTransitions(pwm);
+		benchTranslator<IvyBacklightTraits>("translate_ivy", pwm);
+		benchTranslator<HswBacklightTraits>("translate_hsw", pwm);
+		benchTranslator<KblFakeBacklightTraits>("translate_kbl_fake", pwm);
+		benchTranslator<CflRealBacklightTraits>("translate_cfl_real", pwm);
+		benchTranslator<CflFakeBacklightTraits>("translate_cfl_fake", pwm);
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+//
+//  bench_sysfs.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+#include "fake_sysfs.hpp"
+
+#include <chrono>
+
+// Fades through the sysfs backend against a fake backlight class directory, printed as CSV.
+// ns_per_fade is the wall time of the request and every tick including the file writes, writes_per_fade counts
+// brightness writes and latency_ms is the request to final write time of the fade on the virtual clock.
+
+using namespace SmootherHarness;
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr uint32_t maxima[] {255, 1000, 19393, 96000};
+	static constexpr uint32_t FADES = 200;
+
+	struct Fade {
+		const char *name;
+		uint32_t from;   // percent of max_brightness
+		uint32_t to;
+	};
+
+	static constexpr Fade fades[] {
+		{"fade_full", 0, 100},
+		{"fade_half", 25, 75},
+		{"fade_small", 50, 55},
+	};
+
+	static void report(const char *name, uint32_t maxBrightness, uint32_t count, double nanoseconds, double writes, double latency) {
+		printf("%s,%u,%u,%.2f,%.2f,%.3f\n", name, maxBrightness, count, nanoseconds / count, writes / count, latency / count / MS);
+	}
+
+	// Alternate between two brightness levels, one fade per request. everyStep lifts the write budget.
+	static void benchFade(const char *name, const std::string &path, uint32_t maxBrightness, const Fade &fade, bool everyStep) {
+		reset();
+		SmootherSysfs::install();
+		if (everyStep) {
+			SmootherCore::configuration.writeBudget = 0;
+		}
+		SmootherSysfs::Device device;
+		if (!SmootherSysfs::openDevice(device, path.c_str())) {
+			return;
+		}
+		SmootherSysfs::attach(device);
+		uint32_t from = maxBrightness * fade.from / 100, to = maxBrightness * fade.to / 100;
+		SmootherSysfs::request(device, from);
+		runUntilIdle();
+
+		uint32_t writes = device.writes;
+		double elapsed = 0;
+		uint64_t latency = 0;
+		for (uint32_t i = 0; i < FADES; i++) {
+			uint64_t start = now;
+			auto begin = Clock::now();
+			SmootherSysfs::request(device, i & 1 ? from : to);
+			runUntilIdle();
+			elapsed += std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+			latency += now - start;
+		}
+		report(name, maxBrightness, FADES, elapsed, device.writes - writes, static_cast<double>(latency));
+		SmootherSysfs::closeDevice(device);
+	}
+}
+
+int main() {
+	FakeSysfs sysfs;
+	if (sysfs.directory().empty()) {
+		fprintf(stderr, "bench_sysfs: cannot create a temporary directory\n");
+		return 1;
+	}
+
+	printf("benchmark,max_brightness,fades,ns_per_fade,writes_per_fade,latency_ms\n");
+	for (auto maxBrightness : maxima) {
+		auto path = sysfs.addDevice(("backlight" + std::to_string(maxBrightness)).c_str(), maxBrightness, 0);
+		for (auto &fade : fades) {
+			benchFade(fade.name, path, maxBrightness, fade, false);
+		}
+
+		// The same fades with every step of the curve written.
+		char name[32];
+		for (auto &fade : fades) {
+			snprintf(name, sizeof(name), "%s_every_step", fade.name);
+			benchFade(name, path, maxBrightness, fade, true);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+#  Compare two make bench CSV outputs: compare_bench.sh baseline.csv current.csv
+#  Prints the time ratio per benchmark and PWM maximum, above 1 is slower than the baseline.
+#
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 baseline.csv current.csv" >&2
+	exit 1
+fi
+
+awk -F, '
+	$1 == "benchmark" { next }
+	NR == FNR { baseline[$1 "," $2] = $4; next }
+	($1 "," $2) in baseline && baseline[$1 "," $2] > 0 {
+		printf "%s,%s,%.2f,%.2f,%.3f\n", $1, $2, baseline[$1 "," $2], $4, $4 / baseline[$1 "," $2]
+	}
+' "$1" "$2" | { echo "benchmark,pwm,baseline_ns,current_ns,ratio"; cat; }
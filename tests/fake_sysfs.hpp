@@ -0,0 +1,88 @@
+//
+//  fake_sysfs.hpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#ifndef fake_sysfs_hpp
+#define fake_sysfs_hpp
+
+#include "smoother_sysfs.hpp"
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ *  Temporary directory laid out like /sys/class/backlight, removed again on destruction.
+ *  The attributes are plain files, so brightness keeps the last value written.
+ */
+class FakeSysfs {
+	std::string root;
+
+	static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+		return ::remove(path);
+	}
+
+public:
+	inline FakeSysfs() {
+		const char *base = getenv("TMPDIR");
+		std::string pattern = std::string(base && *base ? base : "/tmp") + "/smoother_sysfs.XXXXXX";
+		if (mkdtemp(&pattern[0])) {
+			root = pattern;
+		}
+	}
+
+	inline ~FakeSysfs() {
+		if (!root.empty()) {
+			nftw(root.c_str(), removeEntry, 8, FTW_DEPTH | FTW_PHYS);
+		}
+	}
+
+	/**
+	 *  The backlight class directory, empty when it could not be created
+	 */
+	inline const std::string &directory() const {
+		return root;
+	}
+
+	/**
+	 *  Add a device directory with the given attributes, returns its path
+	 */
+	inline std::string addDevice(const char *name, uint32_t maxBrightness, uint32_t brightness) {
+		std::string path = root + "/" + name;
+		mkdir(path.c_str(), 0755);
+		setAttribute(path, "max_brightness", std::to_string(maxBrightness) + "\n");
+		setAttribute(path, "brightness", std::to_string(brightness) + "\n");
+		return path;
+	}
+
+	/**
+	 *  Replace the contents of an attribute file
+	 */
+	static inline void setAttribute(const std::string &device, const char *name, const std::string &value) {
+		FILE *file = fopen((device + "/" + name).c_str(), "w");
+		if (file) {
+			fputs(value.c_str(), file);
+			fclose(file);
+		}
+	}
+
+	/**
+	 *  Current value of an attribute file, UINT32_MAX when unreadable
+	 */
+	static inline uint32_t attribute(const std::string &device, const char *name) {
+		FILE *file = fopen((device + "/" + name).c_str(), "r");
+		unsigned value;
+		bool valid = file && fscanf(file, "%u", &value) == 1;
+		if (file) {
+			fclose(file);
+		}
+		return valid ? value : UINT32_MAX;
+	}
+};
+
+#endif /* fake_sysfs_hpp */
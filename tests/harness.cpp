@@ -0,0 +1,169 @@
+//
+//  harness.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+uint32_t MockController::writesTo(uint32_t reg) const {
+	uint32_t count = 0;
+	for (auto &write : writes) {
+		count += write.reg == reg;
+	}
+	return count;
+}
+
+namespace SmootherHarness {
+	uint64_t now;
+	bool timerArmed;
+	uint64_t timerDue;
+	unsigned failures;
+
+	// Engine defaults as compiled in, captured before any test changes them.
+	static const SmootherConfiguration defaultConfiguration = SmootherCore::configuration;
+
+	static bool preparePending;
+
+	static uint32_t readRegister32(void *that, uint32_t reg) {
+		auto controller = static_cast<MockController *>(that);
+		controller->reads++;
+		return controller->registers[reg];
+	}
+
+	static void writeRegister32(void *that, uint32_t reg, uint32_t value) {
+		auto controller = static_cast<MockController *>(that);
+		controller->registers[reg] = value;
+		controller->writes.push_back({now, reg, value});
+	}
+
+	static void scheduleTimer(uint32_t us) {
+		timerArmed = true;
+		timerDue = now + us * 1000ULL;
+	}
+
+	static uint64_t currentTimeNs() {
+		return now;
+	}
+
+	static void schedulePrepare() {
+		preparePending = true;
+	}
+}
+
+void SmootherHarness::reset(bool deferredPrepare) {
+	SmootherCore::reset();
+	SmootherCore::configuration = defaultConfiguration;
+	SmootherCore::traceEnabled = false;
+	SmootherCore::platform = {scheduleTimer, currentTimeNs, deferredPrepare ? schedulePrepare : nullptr, nullptr};
+	SmootherCore::layoutAccessors<IvyBacklightTraits> = {readRegister32, writeRegister32};
+	SmootherCore::layoutAccessors<HswBacklightTraits> = {readRegister32, writeRegister32};
+	SmootherCore::layoutAccessors<KblFakeBacklightTraits> = {readRegister32, writeRegister32};
+	SmootherCore::layoutAccessors<CflRealBacklightTraits> = {readRegister32, writeRegister32};
+	SmootherCore::layoutAccessors<CflFakeBacklightTraits> = {readRegister32, writeRegister32};
+
+	// Start well away from zero, the engine treats some zero timestamps as unset.
+	now = 1000 * MS;
+	timerArmed = false;
+	timerDue = 0;
+	preparePending = false;
+}
+
+void SmootherHarness::poll() {
+	if (preparePending) {
+		preparePending = false;
+		SmootherCore::prepareControllers();
+	}
+	if (timerArmed && timerDue <= now) {
+		timerArmed = false;
+		SmootherCore::dischargeQueue();
+	}
+}
+
+bool SmootherHarness::fire() {
+	if (!timerArmed) {
+		return false;
+	}
+	if (timerDue > now) {
+		now = timerDue;
+	}
+	poll();
+	return true;
+}
+
+uint32_t SmootherHarness::runUntilIdle(uint32_t limit) {
+	uint32_t ticks = 0;
+	while (ticks < limit && fire()) {
+		ticks++;
+	}
+	return ticks;
+}
+
+void SmootherHarness::advance(uint64_t ns) {
+	uint64_t end = now + ns;
+	while (timerArmed && timerDue <= end) {
+		fire();
+	}
+	now = end;
+	poll();
+}
+
+namespace SmootherHarness {
+	template <unsigned N>
+	static void printHistogram(FILE *file, const char *key, const SmootherHistogram<N> &histogram, bool last = false) {
+		fprintf(file, "  \"%s\": [", key);
+		for (size_t i = 0; i < N; i++) {
+			fprintf(file, i ? ", %u" : "%u", histogram.buckets[i]);
+		}
+		fprintf(file, last ? "]\n" : "],\n");
+	}
+}
+
+void SmootherHarness::printStatistics(FILE *file) {
+	auto &statistics = SmootherCore::statistics;
+	uint32_t plans = statistics.planCacheHits + statistics.planCacheMisses;
+	fprintf(file, "{\n");
+	fprintf(file, "  \"Retarget Count\": %u,\n", statistics.retargetCount);
+	fprintf(file, "  \"Queue Overflow Count\": %u,\n", statistics.queueOverflowCount);
+	fprintf(file, "  \"Stale Request Count\": %u,\n", statistics.staleRequestCount);
+	fprintf(file, "  \"Queue High Water\": %u,\n", statistics.queueHighWater);
+	fprintf(file, "  \"Tick Count\": %u,\n", statistics.tickCount);
+	fprintf(file, "  \"Transition Count\": %u,\n", statistics.transitionCount);
+	fprintf(file, "  \"Register Writes Issued\": %u,\n", statistics.writesIssued);
+	fprintf(file, "  \"Register Writes Elided\": %u,\n", statistics.writesElided);
+	fprintf(file, "  \"Catch Up Steps\": %u,\n", statistics.catchUpSteps);
+	fprintf(file, "  \"Plan Cache Hits\": %u,\n", statistics.planCacheHits);
+	fprintf(file, "  \"Plan Cache Misses\": %u,\n", statistics.planCacheMisses);
+	fprintf(file, "  \"Plan Cache Hit Rate\": %llu,\n", plans ? statistics.planCacheHits * 100ULL / plans : 0);
+	fprintf(file, "  \"Applied Requests\": %u,\n", statistics.appliedRequests);
+	fprintf(file, "  \"Filtered Requests\": %u,\n", statistics.filteredRequests);
+	fprintf(file, "  \"Held Requests\": %u,\n", statistics.heldRequests);
+	fprintf(file, "  \"Wake Count\": %u,\n", statistics.wakeCount);
+	fprintf(file, "  \"Sleep Cancelled Transitions\": %u,\n", statistics.sleepCancelCount);
+	fprintf(file, "  \"Last Wake To Backlight Latency\": %llu,\n", static_cast<unsigned long long>(statistics.wakeLatencyLast));
+	fprintf(file, "  \"Last Tick Lateness\": %llu,\n", static_cast<unsigned long long>(statistics.tickLatenessLast));
+	fprintf(file, "  \"Max Tick Lateness\": %llu,\n", static_cast<unsigned long long>(statistics.tickLatenessMax));
+	fprintf(file, "  \"Total Tick Lateness\": %llu,\n", static_cast<unsigned long long>(statistics.tickLatenessTotal));
+	printHistogram(file, "Tick Lateness (us)", statistics.tickLateness);
+	printHistogram(file, "First Write Latency (us)", statistics.firstWriteLatency);
+	printHistogram(file, "Final Write Latency (us)", statistics.finalWriteLatency);
+	printHistogram(file, "Writes Per Transition", statistics.writesPerTransition);
+	printHistogram(file, "Wakeups Per Transition", statistics.wakeupsPerTransition);
+	printHistogram(file, "Wake To Backlight Latency (us)", statistics.wakeLatency, true);
+	fprintf(file, "}\n");
+}
+
+void SmootherHarness::fail(const char *file, int line, const char *condition) {
+	failures++;
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+}
+
+int SmootherHarness::finish(const char *name) {
+	if (failures) {
+		printf("%s: %u checks failed\n", name, failures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
@@ -0,0 +1,123 @@
+//
+//  harness.hpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#ifndef harness_hpp
+#define harness_hpp
+
+#include "kern_smoother_core.hpp"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+/**
+ *  Simulated framebuffer controller, its address is the that pointer handed to the engine.
+ *  Registers read as zero until written.
+ */
+struct MockController {
+	struct Write {
+		uint64_t time;
+		uint32_t reg;
+		uint32_t value;
+	};
+
+	std::map<uint32_t, uint32_t> registers;
+	std::vector<Write> writes;
+	uint32_t reads {0};
+
+	/**
+	 *  Forget the access history, the register contents stay
+	 */
+	void clearLog() {
+		writes.clear();
+		reads = 0;
+	}
+
+	/**
+	 *  Number of logged writes to a register
+	 */
+	uint32_t writesTo(uint32_t reg) const;
+};
+
+namespace SmootherHarness {
+	/**
+	 *  Virtual monotonic clock in ns, only moves when a test advances it
+	 */
+	extern uint64_t now;
+
+	/**
+	 *  Smoothing timer state, timerDue is the virtual time the armed timer fires at
+	 */
+	extern bool timerArmed;
+	extern uint64_t timerDue;
+
+	/**
+	 *  Number of failed checks so far
+	 */
+	extern unsigned failures;
+
+	/**
+	 *  Reset the engine to the default configuration and install the simulated platform and register accessors for every layout.
+	 *  With deferredPrepare the engine asks for prepareControllers like the kext does,
+	 *  and it runs before the next timer tick instead of inline on the first PWM write.
+	 */
+	void reset(bool deferredPrepare = false);
+
+	/**
+	 *  Run a pending prepareControllers request and the smoothing timer if it is due at the current time
+	 */
+	void poll();
+
+	/**
+	 *  Jump to the armed timer deadline and run it, returns false when the timer is idle
+	 */
+	bool fire();
+
+	/**
+	 *  Fire the timer until it goes idle, returns the number of ticks
+	 */
+	uint32_t runUntilIdle(uint32_t limit = 1000000);
+
+	/**
+	 *  Move the clock forward, firing every timer that falls due on the way
+	 */
+	void advance(uint64_t ns);
+
+	/**
+	 *  Forward a driver register write through the translator for a hardware layout
+	 */
+	template <class Traits>
+	inline void write(MockController &controller, uint32_t reg, uint32_t value) {
+		SmootherCore::wrapWriteRegister32<Traits>(&controller, reg, value);
+	}
+
+	/**
+	 *  Print the engine statistics as one JSON object, with the keys of the kext's Smoother Statistics property
+	 */
+	void printStatistics(FILE *file);
+
+	/**
+	 *  Record a failed check
+	 */
+	void fail(const char *file, int line, const char *condition);
+
+	/**
+	 *  Print a summary line, returns the process exit code
+	 */
+	int finish(const char *name);
+
+	static constexpr uint64_t MS = 1000000ULL;
+}
+
+#define SMOOTHER_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			SmootherHarness::fail(__FILE__, __LINE__, #condition); \
+		} \
+	} while (0)
+
+#endif /* harness_hpp */
@@ -0,0 +1,153 @@
+//
+//  replay_trace.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+// Feed the driver writes of a Register Trace dump through the engine again on the virtual clock and print
+// the recorded and the replayed register writes as CSV, to compare engine changes against a captured session.
+// With -j the engine statistics after the replay are printed as JSON instead.
+//
+//   replay_trace [-t ivy|hsw|kbl_fake|cfl_real|cfl_fake] [-p pwm] [-j] dump.bin
+
+using namespace SmootherHarness;
+
+namespace {
+	struct Options {
+		const char *traits {"cfl_real"};
+		uint32_t pwm {0x56C};
+		bool json {false};
+		const char *path {nullptr};
+	};
+
+	struct Dump {
+		SmootherTraceHeader header;
+		std::vector<SmootherTraceRecord> records;
+	};
+
+	static bool load(const char *path, Dump &dump) {
+		FILE *file = fopen(path, "rb");
+		if (!file) {
+			fprintf(stderr, "replay_trace: cannot open %s\n", path);
+			return false;
+		}
+
+		bool valid = fread(&dump.header, sizeof(dump.header), 1, file) == 1 &&
+			dump.header.magic == SmootherCore::TraceMagic && dump.header.version == SmootherCore::TraceVersion &&
+			dump.header.recordSize == sizeof(SmootherTraceRecord);
+		if (valid) {
+			dump.records.resize(dump.header.recordCount);
+			valid = fread(dump.records.data(), sizeof(SmootherTraceRecord), dump.records.size(), file) == dump.records.size();
+		}
+		fclose(file);
+
+		if (!valid) {
+			fprintf(stderr, "replay_trace: %s is not a version %u register trace\n", path, SmootherCore::TraceVersion);
+		}
+		return valid;
+	}
+
+	static double milliseconds(uint64_t ns) {
+		return static_cast<double>(ns) / MS;
+	}
+
+	template <class Traits>
+	static void replay(const Dump &dump, uint32_t pwm, bool json) {
+		reset();
+		MockController controller;
+		controller.registers[BXT_BLC_PWM_FREQ1] = Traits::HardwarePacked ? pwm << 16U : pwm;
+
+		uint64_t base = dump.records.empty() ? 0 : dump.records.front().timestamp;
+		uint64_t start = now;
+		uint32_t recorded = 0, lastRecorded = 0;
+		uint64_t lastRecordedTime = 0;
+		if (!json) {
+			printf("origin,time_ms,reg,value\n");
+		}
+		for (auto &record : dump.records) {
+			uint64_t offset = record.timestamp - base;
+			if (record.source == TraceSource::Timer) {
+				if (!json) {
+					printf("recorded,%.3f,0x%x,0x%x\n", milliseconds(offset), record.reg, record.value);
+				}
+				recorded++;
+				lastRecorded = record.value;
+				lastRecordedTime = offset;
+				continue;
+			}
+
+			// Timers due before the driver write run first, like on the real work loop.
+			if (start + offset > now) {
+				advance(start + offset - now);
+			}
+			write<Traits>(controller, record.reg, record.value);
+		}
+		runUntilIdle();
+
+		if (json) {
+			printStatistics(stdout);
+		} else {
+			for (auto &write : controller.writes) {
+				printf("replayed,%.3f,0x%x,0x%x\n", milliseconds(write.time - start), write.reg, write.value);
+			}
+		}
+
+		uint32_t lastReplayed = controller.writes.empty() ? 0 : controller.writes.back().value;
+		double lastReplayedTime = controller.writes.empty() ? 0 : milliseconds(controller.writes.back().time - start);
+		fprintf(stderr, "replay_trace: %u records, %u lost before the dump\n", dump.header.recordCount, dump.header.lostCount);
+		fprintf(stderr, "replay_trace: recorded %u timer writes, last 0x%x at %.3f ms\n", recorded, lastRecorded, milliseconds(lastRecordedTime));
+		fprintf(stderr, "replay_trace: replayed %zu writes, last 0x%x at %.3f ms\n", controller.writes.size(), lastReplayed, lastReplayedTime);
+	}
+
+	static bool parse(int argc, char **argv, Options &options) {
+		for (int i = 1; i < argc; i++) {
+			if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+				options.traits = argv[++i];
+			} else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+				options.pwm = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+			} else if (!strcmp(argv[i], "-j")) {
+				options.json = true;
+			} else if (argv[i][0] != '-' && !options.path) {
+				options.path = argv[i];
+			} else {
+				return false;
+			}
+		}
+		return options.path && options.pwm;
+	}
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	if (!parse(argc, argv, options)) {
+		fprintf(stderr, "usage: %s [-t ivy|hsw|kbl_fake|cfl_real|cfl_fake] [-p pwm] [-j] dump.bin\n", argv[0]);
+		return 2;
+	}
+
+	Dump dump;
+	if (!load(options.path, dump)) {
+		return 1;
+	}
+
+	if (!strcmp(options.traits, "ivy")) {
+		replay<IvyBacklightTraits>(dump, options.pwm, options.json);
+	} else if (!strcmp(options.traits, "hsw")) {
+		replay<HswBacklightTraits>(dump, options.pwm, options.json);
+	} else if (!strcmp(options.traits, "kbl_fake")) {
+		replay<KblFakeBacklightTraits>(dump, options.pwm, options.json);
+	} else if (!strcmp(options.traits, "cfl_real")) {
+		replay<CflRealBacklightTraits>(dump, options.pwm, options.json);
+	} else if (!strcmp(options.traits, "cfl_fake")) {
+		replay<CflFakeBacklightTraits>(dump, options.pwm, options.json);
+	} else {
+		fprintf(stderr, "replay_trace: unknown register layout %s\n", options.traits);
+		return 2;
+	}
+	return 0;
+}
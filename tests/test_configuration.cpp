@@ -0,0 +1,194 @@
+//
+//  test_configuration.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+#include "kern_smoother_curves.hpp"
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = SmootherCore::FallbackTargetBacklightFrequency;
+
+	static void powerOn(MockController &controller, uint32_t duty) {
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, FIRMWARE_FREQUENCY);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, duty);
+	}
+
+	static void applyCurve(SmootherCurve curve) {
+		auto update = SmootherCore::configuration;
+		update.curve = curve;
+		SMOOTHER_CHECK(SmootherCore::applyConfiguration(update));
+	}
+
+	// Two curve changes between ticks bring the first table buffer back, the fade must still be planned again.
+	static void testBackToBackCurves() {
+		reset();
+		SmootherCore::configuration.curve = SmootherCurve::Cubic;
+		MockController controller;
+		powerOn(controller, 0x100);
+
+		controller.clearLog();
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, FIRMWARE_FREQUENCY);
+		for (int i = 0; i < 40; i++) {
+			fire();
+		}
+		SMOOTHER_CHECK(controller.writes.size() > 10);
+		applyCurve(SmootherCurve::Gamma);
+		applyCurve(SmootherCurve::Exponential);
+		runUntilIdle();
+
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_DUTY1] == FIRMWARE_FREQUENCY);
+		for (size_t i = 1; i < controller.writes.size(); i++) {
+			SMOOTHER_CHECK(controller.writes[i].value > controller.writes[i - 1].value);
+		}
+	}
+
+	// Plans are cached under the generation loaded before the table and are not reused for the next tables.
+	static void testPlanCacheFollowsTables() {
+		reset();
+		MockController mock;
+		powerOn(mock, 0x100);
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		uint32_t from = 0x1000, to = 0x9000;
+
+		uint32_t generation = __atomic_load_n(&controller.tableGeneration, __ATOMIC_ACQUIRE);
+		auto table = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+		uint32_t misses = SmootherCore::statistics.planCacheMisses;
+		SmootherCore::transitionPlan(controller, *table, generation, from, to);
+		auto &cached = SmootherCore::transitionPlan(controller, *table, generation, from, to);
+		SMOOTHER_CHECK(SmootherCore::statistics.planCacheMisses == misses + 1);
+		SMOOTHER_CHECK(cached.index == SmootherCore::dutyUpperBound(*table, from));
+		int quadraticIndex = cached.index;
+
+		applyCurve(SmootherCurve::Gamma);
+		generation = __atomic_load_n(&controller.tableGeneration, __ATOMIC_ACQUIRE);
+		table = __atomic_load_n(&controller.dutyTable, __ATOMIC_ACQUIRE);
+		auto &replanned = SmootherCore::transitionPlan(controller, *table, generation, from, to);
+		SMOOTHER_CHECK(SmootherCore::statistics.planCacheMisses == misses + 2);
+		SMOOTHER_CHECK(replanned.index == SmootherCore::dutyUpperBound(*table, from));
+		SMOOTHER_CHECK(replanned.index != quadraticIndex);
+	}
+
+	static void applySpring(uint32_t springMs) {
+		auto update = SmootherCore::configuration;
+		update.springMs = springMs;
+		SMOOTHER_CHECK(SmootherCore::applyConfiguration(update));
+	}
+
+	// Switching the spring on or off in the middle of a fade continues from the value the panel shows.
+	static void testSpringSwitch(bool on) {
+		reset();
+		// Long uptime, the spring must not count from time zero.
+		now = 12 * 3600 * 1000 * MS;
+		SmootherCore::configuration.springMs = on ? 0 : 300;
+		MockController controller;
+		powerOn(controller, 0x100);
+
+		controller.clearLog();
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, FIRMWARE_FREQUENCY);
+		for (int i = 0; i < 10; i++) {
+			fire();
+		}
+		SMOOTHER_CHECK(controller.writes.size() > 2);
+		applySpring(on ? 300 : 0);
+		uint64_t switched = now;
+		runUntilIdle();
+
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_DUTY1] == FIRMWARE_FREQUENCY);
+		for (size_t i = 1; i < controller.writes.size(); i++) {
+			SMOOTHER_CHECK(controller.writes[i].value > controller.writes[i - 1].value);
+		}
+		if (on) {
+			// A whole settle time from the switch, not from the original request.
+			SMOOTHER_CHECK(controller.writes.back().time - switched >= 250 * MS);
+		}
+	}
+
+	// A request closer than filterDelta table entries to the applied target is dropped on the timer, a larger one fades.
+	static void testFilterDrop() {
+		reset();
+		SmootherCore::configuration.filterDelta = 4;
+		MockController mock;
+		powerOn(mock, 0x100);
+		auto table = SmootherCore::controllerFor(&mock)->dutyTable;
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, table->values[128]);
+		runUntilIdle();
+		SMOOTHER_CHECK(mock.registers[BXT_BLC_PWM_DUTY1] == table->values[128]);
+
+		mock.clearLog();
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, table->values[130]);
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, table->values[126]);
+		runUntilIdle();
+		SMOOTHER_CHECK(mock.writes.empty());
+		SMOOTHER_CHECK(SmootherCore::statistics.filteredRequests == 1);
+		SMOOTHER_CHECK(SmootherCore::statistics.staleRequestCount == 1);
+
+		// Measured from the applied target, not from the dropped request.
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, table->values[133]);
+		runUntilIdle();
+		SMOOTHER_CHECK(mock.registers[BXT_BLC_PWM_DUTY1] == table->values[133]);
+		SMOOTHER_CHECK(mock.writes.size() > 1);
+		SMOOTHER_CHECK(SmootherCore::statistics.filteredRequests == 1);
+	}
+
+	// Requests within the hold window wait for it to end, then only the newest one is applied.
+	static void testHoldRelease() {
+		reset();
+		SmootherCore::configuration.filterHoldMs = 100;
+		MockController mock;
+		powerOn(mock, 0x100);
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		uint64_t start = now;
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, 0x200);
+		advance(10 * MS);
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, 0x400);
+		advance(10 * MS);
+		write<CflRealBacklightTraits>(mock, BXT_BLC_PWM_DUTY1, 0x300);
+		SMOOTHER_CHECK(SmootherCore::statistics.heldRequests == 2);
+
+		advance(start + 99 * MS - now);
+		SMOOTHER_CHECK(controller.requestHeld);
+		SMOOTHER_CHECK(controller.transitionActive ? controller.transition.targetValue == 0x200 : mock.registers[BXT_BLC_PWM_DUTY1] == 0x200);
+		advance(2 * MS);
+		SMOOTHER_CHECK(!controller.requestHeld);
+		SMOOTHER_CHECK(controller.transitionActive && controller.transition.targetValue == 0x300);
+
+		mock.clearLog();
+		runUntilIdle();
+		SMOOTHER_CHECK(mock.registers[BXT_BLC_PWM_DUTY1] == 0x300);
+		for (auto &write : mock.writes) {
+			SMOOTHER_CHECK(write.value <= 0x300);
+		}
+		SMOOTHER_CHECK(SmootherCore::statistics.appliedRequests == 2);
+	}
+
+	// The ranges setProperties and the boot-args accept.
+	static void testCurveValidation() {
+		SMOOTHER_CHECK(SmootherCurves::isValid(SmootherCurve::Quadratic, 0));
+		SMOOTHER_CHECK(!SmootherCurves::isValid(SmootherCurve::Quadratic, 5));
+		SMOOTHER_CHECK(SmootherCurves::isValid(SmootherCurve::Gamma, 0));
+		SMOOTHER_CHECK(SmootherCurves::isValid(SmootherCurve::Gamma, 180));
+		SMOOTHER_CHECK(!SmootherCurves::isValid(SmootherCurve::Gamma, 5));
+		SMOOTHER_CHECK(!SmootherCurves::isValid(SmootherCurve::Gamma, 100000));
+		SMOOTHER_CHECK(SmootherCurves::isValid(SmootherCurve::Exponential, SmootherCurves::FRACTION_BITS - 1));
+		SMOOTHER_CHECK(!SmootherCurves::isValid(SmootherCurve::Exponential, SmootherCurves::FRACTION_BITS));
+		SMOOTHER_CHECK(SmootherCurves::isValid(SmootherCurve::PerceptualLightness, 0));
+		SMOOTHER_CHECK(!SmootherCurves::isValid(static_cast<SmootherCurve>(5), 0));
+	}
+}
+
+int main() {
+	testBackToBackCurves();
+	testPlanCacheFollowsTables();
+	testSpringSwitch(true);
+	testSpringSwitch(false);
+	testFilterDrop();
+	testHoldRelease();
+	testCurveValidation();
+	return finish("test_configuration");
+}
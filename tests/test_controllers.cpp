@@ -0,0 +1,160 @@
+//
+//  test_controllers.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+#include <atomic>
+#include <thread>
+
+using namespace SmootherHarness;
+using SmootherCore::MAX_CONTROLLERS;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = 0x56C;
+	static constexpr uint32_t ROUNDS = 2000;
+	static constexpr uint32_t THREADS = 3;
+
+	static void powerOn(MockController &controller, uint32_t duty) {
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, duty);
+	}
+
+	// Every controller up to MAX_CONTROLLERS gets its own slot, the next ones are passed through untranslated.
+	static void testPassThroughBeyondSlots() {
+		reset();
+		MockController tracked[MAX_CONTROLLERS];
+		for (uint32_t i = 0; i < MAX_CONTROLLERS; i++) {
+			powerOn(tracked[i], 0x1000 * (i + 1));
+			SMOOTHER_CHECK(SmootherCore::controllerFor(&tracked[i]) == &SmootherCore::controllers[i]);
+		}
+
+		MockController extra;
+		powerOn(extra, 0x8000);
+		SMOOTHER_CHECK(SmootherCore::controllerFor(&extra) == nullptr);
+		SMOOTHER_CHECK(extra.registers[BXT_BLC_PWM_FREQ1] == 0xFFFF);
+		SMOOTHER_CHECK(extra.registers[BXT_BLC_PWM_DUTY1] == 0x8000);
+		SMOOTHER_CHECK(extra.reads == 0);
+
+		// The last tracked controller keeps its own state.
+		auto &last = SmootherCore::controllers[MAX_CONTROLLERS - 1];
+		SMOOTHER_CHECK(last.that == &tracked[MAX_CONTROLLERS - 1]);
+		SMOOTHER_CHECK(last.driverBacklightFrequency == 0xFFFF);
+		SMOOTHER_CHECK(last.currentBacklightValue == static_cast<uint32_t>(static_cast<uint64_t>(0x1000 * MAX_CONTROLLERS) * FIRMWARE_FREQUENCY / 0xFFFF));
+		SMOOTHER_CHECK(tracked[MAX_CONTROLLERS - 1].registers[BXT_BLC_PWM_FREQ1] == FIRMWARE_FREQUENCY);
+	}
+
+	// Register functions of a second framebuffer kext, routed through another layout.
+	namespace Second {
+		static uint32_t reads, writes;
+
+		static uint32_t readRegister32(void *that, uint32_t reg) {
+			reads++;
+			return static_cast<MockController *>(that)->registers[reg];
+		}
+
+		static void writeRegister32(void *that, uint32_t reg, uint32_t value) {
+			writes++;
+			auto controller = static_cast<MockController *>(that);
+			controller->registers[reg] = value;
+			controller->writes.push_back({now, reg, value});
+		}
+	}
+
+	static uint32_t rescaled(uint32_t duty) {
+		return static_cast<uint32_t>(static_cast<uint64_t>(duty) * FIRMWARE_FREQUENCY / 0xFFFF);
+	}
+
+	// Overlapping fades on controllers of two framebuffer kexts keep their own duty register and register functions.
+	static void testIndependentFades() {
+		reset();
+		SmootherCore::layoutAccessors<KblFakeBacklightTraits> = {Second::readRegister32, Second::writeRegister32};
+		MockController first, second;
+		powerOn(first, 0x1000);
+		second.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY << 16U;
+		write<KblFakeBacklightTraits>(second, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write<KblFakeBacklightTraits>(second, BXT_BLC_PWM_DUTY1, 0xF000);
+
+		first.clearLog();
+		second.clearLog();
+		Second::writes = 0;
+		write<CflRealBacklightTraits>(first, BXT_BLC_PWM_DUTY1, 0xF000);
+		advance(20 * MS);
+		write<KblFakeBacklightTraits>(second, BXT_BLC_PWM_DUTY1, 0x1000);
+		fire();
+		auto &one = *SmootherCore::controllerFor(&first), &two = *SmootherCore::controllerFor(&second);
+		SMOOTHER_CHECK(one.transitionActive && two.transitionActive);
+		runUntilIdle();
+
+		SMOOTHER_CHECK(one.dutyRegister == BXT_BLC_PWM_DUTY1 && two.dutyRegister == BXT_BLC_PWM_FREQ1);
+		SMOOTHER_CHECK(first.registers[BXT_BLC_PWM_DUTY1] == rescaled(0xF000));
+		SMOOTHER_CHECK(first.writesTo(BXT_BLC_PWM_DUTY1) == first.writes.size() && first.writes.size() > 4);
+		for (size_t i = 1; i < first.writes.size(); i++) {
+			SMOOTHER_CHECK(first.writes[i].value > first.writes[i - 1].value);
+		}
+		SMOOTHER_CHECK(second.registers[BXT_BLC_PWM_FREQ1] == ((FIRMWARE_FREQUENCY << 16U) | rescaled(0x1000)));
+		SMOOTHER_CHECK(second.writesTo(BXT_BLC_PWM_FREQ1) == second.writes.size() && second.writes.size() > 4);
+		for (size_t i = 1; i < second.writes.size(); i++) {
+			SMOOTHER_CHECK(second.writes[i].value >> 16U == FIRMWARE_FREQUENCY);
+			SMOOTHER_CHECK((second.writes[i].value & 0xffffU) < (second.writes[i - 1].value & 0xffffU));
+		}
+
+		// Only the second kext's functions ever touched the second controller.
+		SMOOTHER_CHECK(second.reads == 0 && Second::reads > 0);
+		SMOOTHER_CHECK(Second::writes == second.writes.size());
+	}
+
+	// Threads racing for the same free slots end up with one slot per controller, state set by a winner is never wiped.
+	static void testConcurrentClaims() {
+		int owners[THREADS + 1];
+		uint32_t duplicates = 0, wiped = 0;
+		for (uint32_t round = 0; round < ROUNDS; round++) {
+			reset();
+			std::atomic<uint32_t> ready {0};
+			auto claim = [&ready](void *that) {
+				ready++;
+				while (ready.load() < THREADS) {
+					std::this_thread::yield();
+				}
+				// A slot another thread is still initialising is passed through, the driver's next write tries again.
+				SmootherCore::BacklightController *controller;
+				while (!(controller = SmootherCore::controllerFor(that))) {
+					std::this_thread::yield();
+				}
+				if (controller && controller->that == that) {
+					// The winner's first write, a late initialisation would clear it.
+					__atomic_store_n(&controller->driverBacklightFrequency, 0xFFFF, __ATOMIC_RELAXED);
+				}
+			};
+
+			// Two threads share a controller, the third one has its own.
+			void *shared = &owners[round % THREADS];
+			std::thread threads[THREADS] {std::thread(claim, shared), std::thread(claim, shared), std::thread(claim, &owners[THREADS])};
+			for (auto &thread : threads) {
+				thread.join();
+			}
+
+			uint32_t sharedSlots = 0, ownSlots = 0;
+			for (auto &controller : SmootherCore::controllers) {
+				if (controller.that == shared || controller.that == &owners[THREADS]) {
+					(controller.that == shared ? sharedSlots : ownSlots)++;
+					wiped += controller.driverBacklightFrequency != 0xFFFF;
+				}
+			}
+			duplicates += sharedSlots != 1 || ownSlots != 1;
+		}
+		SMOOTHER_CHECK(duplicates == 0);
+		SMOOTHER_CHECK(wiped == 0);
+	}
+}
+
+int main() {
+	testPassThroughBeyondSlots();
+	testIndependentFades();
+	testConcurrentClaims();
+	return finish("test_controllers");
+}
@@ -0,0 +1,335 @@
+//
+//  test_engine.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = 0x56C;
+	static constexpr uint32_t DRIVER_FREQUENCY = 0xFFFF;
+
+	static uint32_t rescaled(uint32_t duty) {
+		return static_cast<uint32_t>(static_cast<uint64_t>(duty) * FIRMWARE_FREQUENCY / DRIVER_FREQUENCY);
+	}
+
+	template <class Traits>
+	static void setBrightness(MockController &controller, uint32_t duty) {
+		if (Traits::DriverPacked) {
+			write<Traits>(controller, BXT_BLC_PWM_FREQ1, (DRIVER_FREQUENCY << 16U) | duty);
+		} else {
+			write<Traits>(controller, Traits::DriverDutyRegister, duty);
+		}
+	}
+
+	template <class Traits>
+	static void powerOn(MockController &controller, uint32_t duty) {
+		controller.registers[BXT_BLC_PWM_FREQ1] = Traits::HardwarePacked ? FIRMWARE_FREQUENCY << 16U : FIRMWARE_FREQUENCY;
+		if (!Traits::DriverPacked) {
+			write<Traits>(controller, BXT_BLC_PWM_FREQ1, DRIVER_FREQUENCY);
+		}
+		setBrightness<Traits>(controller, duty);
+	}
+
+	// Duty cycles the smoothing timer wrote, checking the frequency half on packed hardware.
+	template <class Traits>
+	static std::vector<uint32_t> dutyWrites(const MockController &controller) {
+		std::vector<uint32_t> values;
+		for (auto &write : controller.writes) {
+			if (write.reg != Traits::DutyRegister) {
+				continue;
+			}
+			if (Traits::HardwarePacked) {
+				SMOOTHER_CHECK(write.value >> 16U == FIRMWARE_FREQUENCY);
+			}
+			values.push_back(Traits::HardwarePacked ? write.value & 0xffffU : write.value);
+		}
+		return values;
+	}
+
+	template <class Traits>
+	static void testFades() {
+		reset();
+		MockController controller;
+		powerOn<Traits>(controller, 0x8000);
+		auto initial = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(!initial.empty() && initial.back() == rescaled(0x8000));
+		SMOOTHER_CHECK(!timerArmed);
+
+		// Fade up, the driver write itself does not touch the duty register.
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0xFFFF);
+		SMOOTHER_CHECK(dutyWrites<Traits>(controller).empty());
+		SMOOTHER_CHECK(timerArmed);
+		uint64_t start = now;
+		runUntilIdle();
+		auto up = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(up.size() > 4);
+		SMOOTHER_CHECK(!up.empty() && up.back() == FIRMWARE_FREQUENCY);
+		for (size_t i = 1; i < up.size(); i++) {
+			SMOOTHER_CHECK(up[i] > up[i - 1]);
+		}
+		for (size_t i = 1; i < controller.writes.size(); i++) {
+			SMOOTHER_CHECK(controller.writes[i].time - controller.writes[i - 1].time >= SmootherCore::DELAYMS * MS);
+		}
+		SMOOTHER_CHECK(now - start >= up.size() * SmootherCore::DELAYMS * MS);
+
+		// Fade down.
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0x100);
+		runUntilIdle();
+		auto down = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(down.size() > 4);
+		SMOOTHER_CHECK(!down.empty() && down.back() == rescaled(0x100));
+		for (size_t i = 1; i < down.size(); i++) {
+			SMOOTHER_CHECK(down[i] < down[i - 1]);
+		}
+
+		// Reverse in the middle of a fade, the panel turns around without jumping.
+		setBrightness<Traits>(controller, 0xC000);
+		runUntilIdle();
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0x1000);
+		for (int i = 0; i < 6; i++) {
+			fire();
+		}
+		auto partial = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(!partial.empty() && partial.back() < rescaled(0xC000) && partial.back() > rescaled(0x1000));
+		setBrightness<Traits>(controller, 0xFFFF);
+		runUntilIdle();
+		auto reversed = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(reversed.size() > partial.size() && reversed.back() == FIRMWARE_FREQUENCY);
+		for (size_t i = partial.size(); i < reversed.size(); i++) {
+			SMOOTHER_CHECK(reversed[i] > reversed[i - 1]);
+		}
+
+		// A burst of requests between two ticks ends on the newest one.
+		controller.clearLog();
+		for (uint32_t duty = 0x3000; duty <= 0xC000; duty += 0x800) {
+			setBrightness<Traits>(controller, duty);
+		}
+		runUntilIdle();
+		auto burst = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(!burst.empty() && burst.back() == rescaled(0xC000));
+		SMOOTHER_CHECK(SmootherCore::statistics.queueOverflowCount + SmootherCore::statistics.staleRequestCount > 0);
+	}
+
+	// The write budget thins out the steps but keeps the pace of walking every table entry.
+	static void testBudgetKeepsPace() {
+		uint64_t walk = 0;
+		for (uint32_t budget : {0U, SmootherCore::DEFAULT_WRITE_BUDGET}) {
+			reset();
+			SmootherCore::configuration.writeBudget = budget;
+			MockController controller;
+			controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+			write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, FIRMWARE_FREQUENCY);
+			write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x500);
+
+			controller.clearLog();
+			uint64_t start = now;
+			write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x10);
+			runUntilIdle();
+			uint64_t duration = controller.writes.back().time - start;
+			SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_DUTY1] == 0x10);
+			if (budget == 0) {
+				// Every distinct table entry on the way, one per tick.
+				SMOOTHER_CHECK(controller.writes.size() > 200);
+				walk = duration;
+			} else {
+				SMOOTHER_CHECK(controller.writes.size() <= budget);
+				SMOOTHER_CHECK(duration > walk - walk / 20 && duration < walk + walk / 20);
+			}
+		}
+	}
+
+	// The driver thread may stamp a request after the tick read the clock, the tick then drains a request from its future.
+	static void setBrightnessAfterTick(MockController &controller, uint32_t duty) {
+		uint64_t tick = timerDue;
+		now = tick + 1000;
+		setBrightness<CflRealBacklightTraits>(controller, duty);
+		now = tick;
+		poll();
+	}
+
+	// Such a request still starts a whole spring animation instead of jumping to the target.
+	static void testSpringRequestAfterTick() {
+		reset();
+		SmootherCore::configuration.springMs = 300;
+		MockController controller;
+		powerOn<CflRealBacklightTraits>(controller, 0x100);
+
+		controller.clearLog();
+		setBrightness<CflRealBacklightTraits>(controller, 0x2000);
+		setBrightnessAfterTick(controller, 0xF000);
+		uint64_t start = now;
+		runUntilIdle();
+		auto fade = dutyWrites<CflRealBacklightTraits>(controller);
+		SMOOTHER_CHECK(fade.size() > 5);
+		SMOOTHER_CHECK(!fade.empty() && fade.back() == rescaled(0xF000));
+		for (size_t i = 1; i < fade.size(); i++) {
+			SMOOTHER_CHECK(fade[i] > fade[i - 1]);
+		}
+		SMOOTHER_CHECK(controller.writes.back().time - start >= 100 * MS);
+	}
+
+	// The longest settle time the boot-arg takes, with a tick arriving many hours after the previous one.
+	static void testLongSpring() {
+		reset();
+		SmootherCore::configuration.springMs = UINT32_MAX;
+		MockController controller;
+		powerOn<CflRealBacklightTraits>(controller, 0x100);
+
+		controller.clearLog();
+		setBrightness<CflRealBacklightTraits>(controller, 0xF000);
+		fire();
+		now += 200 * 3600 * 1000 * MS;
+		fire();
+		// 200 hours of 49.7 days move the spring part of the way.
+		auto fade = dutyWrites<CflRealBacklightTraits>(controller);
+		SMOOTHER_CHECK(!fade.empty() && fade.back() > rescaled(0x100) && fade.back() < rescaled(0xF000) / 2);
+		SMOOTHER_CHECK(timerArmed);
+	}
+
+	// Fade from 0x1000 to 0xF000 with every tick the given time late, returns the time to the final write.
+	static uint64_t lateFade(uint64_t late) {
+		reset();
+		SmootherCore::configuration.writeBudget = 0;
+		MockController controller;
+		powerOn<CflRealBacklightTraits>(controller, 0x1000);
+
+		controller.clearLog();
+		uint64_t start = now;
+		setBrightness<CflRealBacklightTraits>(controller, 0xF000);
+		while (timerArmed) {
+			now = timerDue + late;
+			poll();
+		}
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_DUTY1] == rescaled(0xF000));
+		return controller.writes.empty() ? 0 : controller.writes.back().time - start;
+	}
+
+	// A late timer takes extra steps instead of stretching the fade, whether it is late by less or more than a step.
+	static void testLateTicks() {
+		uint64_t onTime = lateFade(0);
+		SMOOTHER_CHECK(onTime > 500 * MS);
+		for (uint64_t late : {MS / 2, 2 * MS, 5 * MS, 20 * MS}) {
+			uint64_t duration = lateFade(late);
+			SMOOTHER_CHECK(duration >= onTime && duration <= onTime + late + MS);
+			if (duration < onTime || duration > onTime + late + MS) {
+				fprintf(stderr, "test_engine: %llu us late per tick took %llu ms, %llu ms on time\n", static_cast<unsigned long long>(late / 1000),
+						static_cast<unsigned long long>(duration / MS), static_cast<unsigned long long>(onTime / MS));
+			}
+		}
+	}
+
+	// Sleep drops the fade in flight, the first brightness after wake is written at once and later changes fade again.
+	template <class Traits>
+	static void testSleepWake() {
+		reset();
+		MockController controller;
+		powerOn<Traits>(controller, 0x1000);
+		setBrightness<Traits>(controller, 0xF000);
+		for (int i = 0; i < 4; i++) {
+			fire();
+		}
+		auto partial = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(!partial.empty() && partial.back() < rescaled(0xF000));
+
+		SmootherCore::systemWillSleep();
+		SMOOTHER_CHECK(SmootherCore::statistics.sleepCancelCount == 1);
+		controller.clearLog();
+		runUntilIdle();
+		SMOOTHER_CHECK(dutyWrites<Traits>(controller).empty());
+
+		// The driver turns the panel off on the way down, nothing is smoothed while asleep.
+		setBrightness<Traits>(controller, 0);
+		auto off = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(off.size() == 1 && off.back() == 0);
+		advance(1000 * MS);
+
+		SmootherCore::systemDidWake();
+		SMOOTHER_CHECK(SmootherCore::statistics.wakeCount == 1);
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0x8000);
+		auto restored = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(restored.size() == 1 && restored.back() == rescaled(0x8000));
+		SMOOTHER_CHECK(!timerArmed);
+		uint32_t latencies = 0;
+		for (auto bucket : SmootherCore::statistics.wakeLatency.buckets) {
+			latencies += bucket;
+		}
+		SMOOTHER_CHECK(latencies == 1);
+
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0x2000);
+		SMOOTHER_CHECK(dutyWrites<Traits>(controller).empty());
+		SMOOTHER_CHECK(timerArmed);
+		runUntilIdle();
+		auto down = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(down.size() > 4 && down.back() == rescaled(0x2000));
+		for (size_t i = 1; i < down.size(); i++) {
+			SMOOTHER_CHECK(down[i] < down[i - 1]);
+		}
+	}
+
+	// With the work loop preparing the controller, the power on writes wait for it instead of reading the firmware frequency inline.
+	template <class Traits>
+	static void testDeferredPrepare() {
+		reset(true);
+		MockController controller;
+		powerOn<Traits>(controller, 0x8000);
+		SMOOTHER_CHECK(controller.reads == 0);
+		SMOOTHER_CHECK(controller.writes.empty());
+
+		poll();
+		SMOOTHER_CHECK(controller.reads > 0);
+		uint32_t frequency = controller.registers[BXT_BLC_PWM_FREQ1];
+		SMOOTHER_CHECK((Traits::HardwarePacked ? frequency >> 16U : frequency) == FIRMWARE_FREQUENCY);
+		auto initial = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(!initial.empty() && initial.back() == rescaled(0x8000));
+		SMOOTHER_CHECK(!timerArmed);
+
+		// Later writes are translated and smoothed as usual.
+		controller.clearLog();
+		setBrightness<Traits>(controller, 0xFFFF);
+		runUntilIdle();
+		auto up = dutyWrites<Traits>(controller);
+		SMOOTHER_CHECK(up.size() > 4);
+		SMOOTHER_CHECK(!up.empty() && up.back() == FIRMWARE_FREQUENCY);
+	}
+
+	// Without a timer the translators write through at once.
+	static void testWithoutTimer() {
+		reset();
+		SmootherCore::platform.scheduleTimer = nullptr;
+		MockController controller;
+		powerOn<CflRealBacklightTraits>(controller, 0x8000);
+		setBrightness<CflRealBacklightTraits>(controller, 0x4000);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_DUTY1] == rescaled(0x4000));
+	}
+}
+
+int main() {
+	testFades<IvyBacklightTraits>();
+	testFades<HswBacklightTraits>();
+	testFades<KblFakeBacklightTraits>();
+	testFades<CflRealBacklightTraits>();
+	testFades<CflFakeBacklightTraits>();
+	testBudgetKeepsPace();
+	testLateTicks();
+	testSleepWake<IvyBacklightTraits>();
+	testSleepWake<HswBacklightTraits>();
+	testSleepWake<CflRealBacklightTraits>();
+	testSleepWake<CflFakeBacklightTraits>();
+	testDeferredPrepare<IvyBacklightTraits>();
+	testDeferredPrepare<CflRealBacklightTraits>();
+	testDeferredPrepare<CflFakeBacklightTraits>();
+	testWithoutTimer();
+	testSpringRequestAfterTick();
+	testLongSpring();
+	return finish("test_engine");
+}
@@ -0,0 +1,108 @@
+//
+//  test_lookup.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+using SmootherCore::STEPS;
+
+namespace {
+	// The binary searches the branchless lookups replaced.
+	static int legacyLowerBound(const uint32_t *data, int from, int to, uint32_t value) {
+		int result = to--, mid;
+		while (from <= to) {
+			mid = (from + to) >> 1;
+			if (data[mid] >= value) {
+				result = mid;
+				to = mid - 1;
+			} else {
+				from = mid + 1;
+			}
+		}
+		return result;
+	}
+
+	static int legacyUpperBound(const uint32_t *data, int from, int to, uint32_t value) {
+		int result = to--, mid;
+		while (from <= to) {
+			mid = (from + to) >> 1;
+			if (data[mid] > value) {
+				result = mid;
+				to = mid - 1;
+			} else {
+				from = mid + 1;
+			}
+		}
+		return result;
+	}
+
+	// Whole table lookups for every value of small maxima and a stride of values for larger ones.
+	static void testWholeTable() {
+		uint64_t checked = 0, mismatches = 0;
+		SmootherCore::DutyTable table;
+		for (uint32_t frequency = SmootherCore::START_VALUE + 1; frequency <= 200000; frequency += frequency < 5000 ? 1 : 97) {
+			table.quadraticFrequency = frequency;
+			for (uint32_t step = 0; step < STEPS; step++) {
+				table.values[step] = SmootherCore::quadraticDuty(frequency, step);
+			}
+			for (uint32_t value = 0; value <= frequency + 3; value += frequency < 5000 ? 1 : 7) {
+				int lower = legacyLowerBound(table.values, 0, STEPS, value);
+				int upper = legacyUpperBound(table.values, 0, STEPS, value);
+				mismatches += SmootherCore::lowerBound(table.values, 0, STEPS, value) != lower;
+				mismatches += SmootherCore::upperBound(table.values, 0, STEPS, value) != upper;
+				mismatches += SmootherCore::dutyLowerBound(table, value) != lower;
+				mismatches += SmootherCore::dutyUpperBound(table, value) != upper;
+				checked++;
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+		printf("test_lookup: %llu values checked on whole tables\n", static_cast<unsigned long long>(checked));
+	}
+
+	// The branchless searches also take partial ranges and tables of other curves.
+	static void testPartialRanges() {
+		uint64_t mismatches = 0;
+		uint32_t values[STEPS];
+		for (uint32_t step = 0; step < STEPS; step++) {
+			values[step] = SmootherCore::quadraticDuty(0x56C, step);
+		}
+		for (int from = 0; from <= static_cast<int>(STEPS); from++) {
+			for (int to = from; to <= static_cast<int>(STEPS); to++) {
+				for (uint32_t value = 0; value < 0x570; value += 3) {
+					mismatches += SmootherCore::lowerBound(values, from, to, value) != legacyLowerBound(values, from, to, value);
+					mismatches += SmootherCore::upperBound(values, from, to, value) != legacyUpperBound(values, from, to, value);
+				}
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+	}
+
+	static void testOtherCurves() {
+		uint64_t mismatches = 0;
+		SmootherHarness::reset();
+		MockController mock;
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		controller.targetBacklightFrequency = 0x7A1;
+		for (auto curve : {SmootherCurve::Cubic, SmootherCurve::Gamma, SmootherCurve::Exponential, SmootherCurve::PerceptualLightness}) {
+			SmootherCore::configuration.curve = curve;
+			SmootherCore::generateTables(controller);
+			auto &table = *controller.dutyTable;
+			SMOOTHER_CHECK(table.quadraticFrequency == 0);
+			for (uint32_t value = 0; value < 0x7A5; value++) {
+				mismatches += SmootherCore::dutyLowerBound(table, value) != legacyLowerBound(table.values, 0, STEPS, value);
+				mismatches += SmootherCore::dutyUpperBound(table, value) != legacyUpperBound(table.values, 0, STEPS, value);
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+	}
+}
+
+int main() {
+	testWholeTable();
+	testPartialRanges();
+	testOtherCurves();
+	return SmootherHarness::finish("test_lookup");
+}
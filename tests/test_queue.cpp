@@ -0,0 +1,180 @@
+//
+//  test_queue.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr auto STRESS_TIME = std::chrono::seconds(1);
+
+	// Every value arrives exactly once and in order, full pushes are reported and retried.
+	static void testOrdering() {
+		static AtomicQueue<uint32_t, 16> queue;
+		std::atomic<bool> stop {false};
+		std::atomic<uint32_t> rejected {0};
+
+		// Zero marks the end of the stream.
+		std::thread producer([&stop, &rejected] {
+			uint32_t next = 1;
+			while (true) {
+				uint32_t value = stop ? 0 : next++;
+				while (!queue.push(value)) {
+					rejected++;
+					std::this_thread::yield();
+				}
+				if (value == 0) {
+					break;
+				}
+			}
+		});
+
+		auto end = std::chrono::steady_clock::now() + STRESS_TIME;
+		uint32_t expected = 1, value, mismatches = 0, overfull = 0;
+		while (true) {
+			if (!stop && std::chrono::steady_clock::now() >= end) {
+				stop = true;
+			}
+			if (queue.count() > 16) {
+				overfull++;
+			}
+			if (!queue.fetch(value)) {
+				std::this_thread::yield();
+				continue;
+			}
+			if (value == 0) {
+				break;
+			}
+			mismatches += value != expected;
+			expected++;
+		}
+		producer.join();
+
+		SMOOTHER_CHECK(mismatches == 0);
+		SMOOTHER_CHECK(overfull == 0);
+		SMOOTHER_CHECK(queue.isEmpty());
+		printf("test_queue: %u values, %u full pushes retried\n", expected - 1, rejected.load());
+	}
+
+	static void testOverflow() {
+		AtomicQueue<uint32_t, 4> queue;
+		for (uint32_t i = 0; i < 4; i++) {
+			SMOOTHER_CHECK(queue.push(i));
+		}
+		SMOOTHER_CHECK(!queue.push(4));
+		SMOOTHER_CHECK(queue.count() == 4);
+		uint32_t value;
+		SMOOTHER_CHECK(queue.fetch(value) && value == 0);
+		SMOOTHER_CHECK(queue.push(4));
+	}
+
+	// The engine with the driver and the timer on separate threads, as in the kext.
+	namespace Threaded {
+		static std::atomic<uint32_t> dutyRegister;
+		static std::atomic<bool> timerPending;
+		static std::atomic<uint32_t> writes;
+
+		static uint32_t readRegister32(void *, uint32_t reg) {
+			return reg == BXT_BLC_PWM_FREQ1 ? 0x56C : dutyRegister.load();
+		}
+
+		static void writeRegister32(void *, uint32_t reg, uint32_t value) {
+			if (reg == BXT_BLC_PWM_DUTY1) {
+				dutyRegister = value;
+				writes++;
+			}
+		}
+
+		static void scheduleTimer(uint32_t) {
+			timerPending = true;
+		}
+
+		static uint64_t currentTimeNs() {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+	}
+
+	// The driver keeps the ring at most half full, so requests pass through it under contention instead of overflowing.
+	static constexpr unsigned PACED_DEPTH = 8;
+
+	static void testThreadedEngine() {
+		reset();
+		SmootherCore::platform = {Threaded::scheduleTimer, Threaded::currentTimeNs, nullptr, nullptr};
+		SmootherCore::layoutAccessors<CflRealBacklightTraits> = {Threaded::readRegister32, Threaded::writeRegister32};
+		SmootherCore::configuration.tickMs = 1;
+		static int that;
+		auto write = SmootherCore::wrapWriteRegister32<CflRealBacklightTraits>;
+		write(&that, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write(&that, BXT_BLC_PWM_DUTY1, 0x8000);
+		auto &controller = *SmootherCore::controllerFor(&that);
+
+		// Every tick takes the newest request it drained. Requests are stamped in order, so with FIFO order
+		// the transition the timer follows never goes back to an older request.
+		std::atomic<bool> done {false};
+		std::atomic<uint32_t> reordered {0}, followed {0};
+		std::thread timer([&done, &controller, &reordered, &followed] {
+			uint64_t newest = 0;
+			// Ignore the requested delay, firing early and often is the worst case for the queue.
+			while (!done || Threaded::timerPending) {
+				if (!Threaded::timerPending.exchange(false)) {
+					std::this_thread::yield();
+					continue;
+				}
+				SmootherCore::dischargeQueue();
+				if (controller.transitionActive && controller.transition.startTime != newest) {
+					reordered += controller.transition.startTime < newest;
+					newest = controller.transition.startTime;
+					followed++;
+				}
+				// Give the driver thread a turn on machines with few cores.
+				std::this_thread::yield();
+			}
+		});
+
+		uint32_t requests = 0, last = 0;
+		auto end = std::chrono::steady_clock::now() + STRESS_TIME;
+		while (std::chrono::steady_clock::now() < end) {
+			if (controller.requestQueue.count() >= PACED_DEPTH) {
+				std::this_thread::yield();
+				continue;
+			}
+			last = (++requests * 2654435761U) >> 16;
+			write(&that, BXT_BLC_PWM_DUTY1, last);
+		}
+		// Let the last transition finish, a lost request would leave the panel short of it for good.
+		uint32_t expected = static_cast<uint32_t>(last * 0x56CULL / 0xFFFF);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while ((Threaded::timerPending || Threaded::dutyRegister != expected) && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::yield();
+		}
+		done = true;
+		timer.join();
+
+		auto &statistics = SmootherCore::statistics;
+		SMOOTHER_CHECK(Threaded::dutyRegister == expected);
+		if (Threaded::dutyRegister != expected) {
+			fprintf(stderr, "test_queue: duty 0x%x, expected 0x%x, transition %d to 0x%x, %u queued, dropped %d\n", Threaded::dutyRegister.load(), expected,
+					controller.transitionActive, controller.transition.targetValue, controller.requestQueue.count(), controller.requestDropped);
+		}
+		SMOOTHER_CHECK(reordered == 0);
+		SMOOTHER_CHECK(followed > 100);
+		SMOOTHER_CHECK(statistics.queueOverflowCount < requests / 100);
+		printf("test_queue: %u requests, %u through the ring, %u followed by the timer, %u register writes, %u overflowed\n", requests,
+			   requests - statistics.queueOverflowCount, followed.load(), Threaded::writes.load(), statistics.queueOverflowCount);
+	}
+}
+
+int main() {
+	testOrdering();
+	testOverflow();
+	testThreadedEngine();
+	return finish("test_queue");
+}
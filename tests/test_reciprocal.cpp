@@ -0,0 +1,64 @@
+//
+//  test_reciprocal.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+namespace {
+	static constexpr uint32_t targets[] {
+		SmootherCore::FallbackTargetBacklightFrequency, 0x56C, 0x710, 0x7A1, 0xAD9, 0xFFFF,
+		1, 7, 937, 1U << 20, 0x1000000, 0x7fffffff, 0xffffffff,
+	};
+
+	// Every 16-bit duty cycle for every target and a spread of divisors, including the usual driver frequencies.
+	static void testExhaustive() {
+		uint64_t checked = 0, mismatches = 0, fallbacks = 0;
+		for (auto target : targets) {
+			std::vector<uint32_t> divisors {0x56C, 0x7A1, 0xAD9, 0xFFFF, SmootherCore::FallbackTargetBacklightFrequency};
+			for (uint64_t divisor = 1; divisor <= UINT32_MAX; divisor = divisor < 0x10000 ? divisor + 61 : divisor * 3 + 1) {
+				divisors.push_back(static_cast<uint32_t>(divisor));
+			}
+
+			for (auto divisor : divisors) {
+				auto reciprocal = SmootherCore::makeReciprocal(target, divisor);
+				if (reciprocal.shift == 0) {
+					fallbacks++;
+					continue;
+				}
+				for (uint32_t value = 0; value <= 0xffff; value++) {
+					uint32_t fast = static_cast<uint32_t>((value * reciprocal.multiplier) >> reciprocal.shift);
+					mismatches += fast != static_cast<uint32_t>(static_cast<uint64_t>(value) * target / divisor);
+				}
+				checked += 0x10000;
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+		printf("test_reciprocal: %llu products checked, %llu pairs need a division\n", static_cast<unsigned long long>(checked), static_cast<unsigned long long>(fallbacks));
+	}
+
+	// rescaleDuty follows frequency changes and falls back to a division outside the exact range.
+	static void testRescaleDuty() {
+		SmootherHarness::reset();
+		MockController mock;
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		uint64_t mismatches = 0;
+		for (uint32_t target : {0x56CU, 0xAD9U, 120000U}) {
+			controller.targetBacklightFrequency = target;
+			for (uint32_t divisor : {0x56CU, 0xFFFFU, 0x12345U}) {
+				for (uint32_t value : {0U, 1U, 0x8000U, 0xffffU, 0x10000U, 0x12345U, 0xffffffffU}) {
+					mismatches += SmootherCore::rescaleDuty(controller, value, divisor) != static_cast<uint32_t>(static_cast<uint64_t>(value) * target / divisor);
+				}
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+	}
+}
+
+int main() {
+	testExhaustive();
+	testRescaleDuty();
+	return SmootherHarness::finish("test_reciprocal");
+}
@@ -0,0 +1,145 @@
+//
+//  test_shadow.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = 0x56C;
+
+	// Kaby Lake-R keeps frequency and duty cycle in one register, steady brightness changes must not read it.
+	static void testPackedSteadyState() {
+		reset();
+		MockController controller;
+		controller.registers[BXT_BLC_PWM_FREQ1] = (FIRMWARE_FREQUENCY << 16U) | 0x100;
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_FREQ1] == ((FIRMWARE_FREQUENCY << 16U) | 0x100));
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x8000);
+
+		controller.clearLog();
+		for (uint32_t duty = 0; duty <= 0xFFFF; duty += 0x555) {
+			write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, duty);
+			advance(3 * MS);
+		}
+		runUntilIdle();
+		SMOOTHER_CHECK(controller.reads == 0);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_FREQ1] >> 16U == FIRMWARE_FREQUENCY);
+		SMOOTHER_CHECK(!controller.writes.empty());
+	}
+
+	// The zero frequency sleep write drops the shadow copies, the firmware reprograms the register on wake.
+	static void testSleepInvalidates() {
+		reset();
+		MockController controller;
+		controller.registers[BXT_BLC_PWM_FREQ1] = (FIRMWARE_FREQUENCY << 16U) | 0x100;
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x8000);
+
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_FREQ1] >> 16U == 0);
+		controller.registers[BXT_BLC_PWM_FREQ1] = (FIRMWARE_FREQUENCY << 16U) | 0x123;
+
+		// The wake write keeps the duty cycle the hardware holds now, not the one from before sleep.
+		controller.clearLog();
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		SMOOTHER_CHECK(controller.reads > 0);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_FREQ1] == ((FIRMWARE_FREQUENCY << 16U) | 0x123));
+
+		// Afterwards the shadow copies serve the reads again.
+		controller.clearLog();
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x9000);
+		write<KblFakeBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0xA000);
+		runUntilIdle();
+		SMOOTHER_CHECK(controller.reads == 0);
+	}
+
+	// Coffee Lake hardware behind the Kaby Lake driver reads PWM control once, for the firmware value.
+	static void testPwmControlReads() {
+		reset();
+		MockController controller;
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		controller.registers[BXT_BLC_PWM_CTL1] = 0x80000000;
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF8000);
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0x80000001);
+		uint32_t reads = controller.reads;
+
+		for (int i = 0; i < 10; i++) {
+			write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0x80000001);
+			write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF0000 | (0x1000U * i));
+		}
+		runUntilIdle();
+		SMOOTHER_CHECK(controller.reads == reads);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_CTL1] == 0x80000000);
+	}
+
+	static void powerOnCoffeeLake(MockController &controller) {
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		controller.registers[BXT_BLC_PWM_CTL1] = 0x80000000;
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF8000);
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0x80000001);
+	}
+
+	// Values only read from the hardware do not suppress the driver's writes.
+	static void testInitialWritesReachHardware() {
+		reset();
+		MockController controller;
+		powerOnCoffeeLake(controller);
+		SMOOTHER_CHECK(controller.writesTo(BXT_BLC_PWM_FREQ1) >= 2);
+		SMOOTHER_CHECK(controller.writesTo(BXT_BLC_PWM_CTL1) == 1);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_CTL1] == 0x80000000);
+	}
+
+	// The frequency rewrite on every Coffee Lake brightness change is skipped once the plugin wrote it.
+	static void testRepeatedWritesElided() {
+		reset();
+		MockController controller;
+		powerOnCoffeeLake(controller);
+
+		controller.clearLog();
+		uint32_t elided = SmootherCore::statistics.writesElided;
+		for (uint32_t duty = 0x1000; duty <= 0xF000; duty += 0x1000) {
+			write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF0000 | duty);
+			runUntilIdle();
+		}
+		SMOOTHER_CHECK(controller.writesTo(BXT_BLC_PWM_FREQ1) == 0);
+		SMOOTHER_CHECK(controller.writesTo(BXT_BLC_PWM_DUTY1) > 0);
+		SMOOTHER_CHECK(SmootherCore::statistics.writesElided - elided >= 15);
+	}
+
+	// Display off and on without system sleep: the hardware lost the frequency and it must be written again.
+	static void testPwmPowerCycle() {
+		reset();
+		MockController controller;
+		powerOnCoffeeLake(controller);
+
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_CTL1] == 0);
+		controller.registers[BXT_BLC_PWM_FREQ1] = 0;
+
+		controller.clearLog();
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0x80000001);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_FREQ1] == FIRMWARE_FREQUENCY);
+		SMOOTHER_CHECK(controller.registers[BXT_BLC_PWM_CTL1] == 0x80000000);
+		SMOOTHER_CHECK(controller.writes.size() == 2 && controller.writes[0].reg == BXT_BLC_PWM_FREQ1);
+
+		// Enabling again without switching off still sets the frequency first.
+		controller.clearLog();
+		write<CflFakeBacklightTraits>(controller, BXT_BLC_PWM_CTL1, 0x80000001);
+		SMOOTHER_CHECK(controller.writesTo(BXT_BLC_PWM_FREQ1) == 1 && controller.writesTo(BXT_BLC_PWM_CTL1) == 1);
+	}
+}
+
+int main() {
+	testPackedSteadyState();
+	testSleepInvalidates();
+	testPwmControlReads();
+	testInitialWritesReachHardware();
+	testRepeatedWritesElided();
+	testPwmPowerCycle();
+	return finish("test_shadow");
+}
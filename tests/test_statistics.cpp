@@ -0,0 +1,139 @@
+//
+//  test_statistics.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+#include <string>
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = 0x56C;
+
+	static uint32_t published;
+
+	static void publishState() {
+		published++;
+	}
+
+	static void powerOn(MockController &controller, uint32_t duty) {
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, duty);
+	}
+
+	template <unsigned N>
+	static uint32_t total(const SmootherHistogram<N> &histogram) {
+		uint32_t count = 0;
+		for (auto bucket : histogram.buckets) {
+			count += bucket;
+		}
+		return count;
+	}
+
+	// Index of the highest nonempty bucket, values in bucket b are below 2 ^ b.
+	template <unsigned N>
+	static size_t highest(const SmootherHistogram<N> &histogram) {
+		size_t bucket = 0;
+		for (size_t i = 0; i < N; i++) {
+			if (histogram.buckets[i]) {
+				bucket = i;
+			}
+		}
+		return bucket;
+	}
+
+	static std::string json() {
+		FILE *file = tmpfile();
+		if (!file) {
+			return {};
+		}
+		printStatistics(file);
+		std::string text(static_cast<size_t>(ftell(file)), '\0');
+		rewind(file);
+		text.resize(fread(&text[0], 1, text.size(), file));
+		fclose(file);
+		return text;
+	}
+
+	static bool hasEntry(const std::string &text, const std::string &key, uint64_t value) {
+		return text.find("\"" + key + "\": " + std::to_string(value) + ",") != std::string::npos;
+	}
+
+	// One fade and one retarget, every counter matches what the controller saw.
+	static void testCounters() {
+		reset();
+		published = 0;
+		SmootherCore::platform.publishState = publishState;
+		MockController controller;
+		powerOn(controller, 0x1000);
+		controller.clearLog();
+
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0xC000);
+		advance(30 * MS);
+		// Two requests before the next tick, the older one is stale.
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x2000);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x4000);
+		uint32_t ticks = runUntilIdle();
+
+		auto &statistics = SmootherCore::statistics;
+		uint32_t writes = controller.writesTo(BXT_BLC_PWM_DUTY1);
+		SMOOTHER_CHECK(statistics.transitionCount == 1);
+		SMOOTHER_CHECK(statistics.retargetCount == 1);
+		SMOOTHER_CHECK(statistics.staleRequestCount == 1);
+		SMOOTHER_CHECK(statistics.queueHighWater == 2);
+		SMOOTHER_CHECK(statistics.queueOverflowCount == 0);
+		SMOOTHER_CHECK(statistics.appliedRequests == 3);
+		SMOOTHER_CHECK(statistics.filteredRequests == 0 && statistics.heldRequests == 0);
+		SMOOTHER_CHECK(statistics.tickCount >= ticks && statistics.tickCount > 3);
+		SMOOTHER_CHECK(published == statistics.tickCount);
+		// The power on frequency and duty writes go straight through and are counted as well.
+		SMOOTHER_CHECK(statistics.writesIssued == writes + 2 && statistics.writesElided == 0);
+		SMOOTHER_CHECK(total(statistics.firstWriteLatency) == 2);
+		SMOOTHER_CHECK(total(statistics.finalWriteLatency) == 1);
+		SMOOTHER_CHECK(total(statistics.writesPerTransition) == 2);
+		SMOOTHER_CHECK(total(statistics.wakeupsPerTransition) == 2);
+		SMOOTHER_CHECK(total(statistics.tickLateness) == statistics.tickCount);
+		SMOOTHER_CHECK(statistics.tickLatenessMax == 0);
+
+		auto text = json();
+		SMOOTHER_CHECK(!text.empty() && text.front() == '{' && text.find("}\n") == text.size() - 2);
+		SMOOTHER_CHECK(hasEntry(text, "Transition Count", statistics.transitionCount));
+		SMOOTHER_CHECK(hasEntry(text, "Retarget Count", statistics.retargetCount));
+		SMOOTHER_CHECK(hasEntry(text, "Tick Count", statistics.tickCount));
+		SMOOTHER_CHECK(hasEntry(text, "Register Writes Issued", statistics.writesIssued));
+		SMOOTHER_CHECK(hasEntry(text, "Stale Request Count", statistics.staleRequestCount));
+		SMOOTHER_CHECK(text.find("\"Final Write Latency (us)\": [") != std::string::npos);
+	}
+
+	// A request stamped after the tick read the clock must not show up as a latency of 2 ^ 64 ns.
+	static void testRequestAfterTick() {
+		reset();
+		MockController controller;
+		powerOn(controller, 0x1000);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x8000);
+		fire();
+		uint64_t tick = timerDue;
+		now = tick + MS;
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0xF000);
+		now = tick;
+		poll();
+		runUntilIdle();
+
+		auto &statistics = SmootherCore::statistics;
+		SMOOTHER_CHECK(statistics.transitionCount == 1);
+		// Any fade here takes well under 2 ^ 21 us.
+		SMOOTHER_CHECK(highest(statistics.firstWriteLatency) <= 21);
+		SMOOTHER_CHECK(highest(statistics.finalWriteLatency) <= 21);
+	}
+}
+
+int main() {
+	testCounters();
+	testRequestAfterTick();
+	return finish("test_statistics");
+}
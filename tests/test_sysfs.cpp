@@ -0,0 +1,155 @@
+//
+//  test_sysfs.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+#include "fake_sysfs.hpp"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <vector>
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t MAX_BRIGHTNESS = 1000;
+
+	// Brightness values in the fake attribute after each timer tick, until the timer goes idle.
+	static std::vector<uint32_t> fade(const std::string &path) {
+		std::vector<uint32_t> values;
+		while (fire()) {
+			uint32_t value = FakeSysfs::attribute(path, "brightness");
+			if (values.empty() || values.back() != value) {
+				values.push_back(value);
+			}
+		}
+		return values;
+	}
+
+	// The first device in name order is picked, whatever order the directory lists them in.
+	static void testFindDevice() {
+		FakeSysfs sysfs;
+		SMOOTHER_CHECK(!sysfs.directory().empty());
+		char path[PATH_MAX];
+		SMOOTHER_CHECK(!SmootherSysfs::findDevice(path, sizeof(path), sysfs.directory().c_str()));
+
+		sysfs.addDevice("intel_backlight", MAX_BRIGHTNESS, 0);
+		sysfs.addDevice("acpi_video0", 15, 0);
+		SMOOTHER_CHECK(SmootherSysfs::findDevice(path, sizeof(path), sysfs.directory().c_str()));
+		SMOOTHER_CHECK(path == sysfs.directory() + "/acpi_video0");
+		SMOOTHER_CHECK(!SmootherSysfs::findDevice(path, sizeof(path), (sysfs.directory() + "/missing").c_str()));
+	}
+
+	static void testOpenDevice() {
+		FakeSysfs sysfs;
+		SmootherSysfs::Device device;
+		SMOOTHER_CHECK(!SmootherSysfs::openDevice(device, (sysfs.directory() + "/missing").c_str()));
+
+		// Too few levels to build a duty table on.
+		auto tiny = sysfs.addDevice("tiny", SmootherCore::START_VALUE, 0);
+		SMOOTHER_CHECK(!SmootherSysfs::openDevice(device, tiny.c_str()));
+		auto broken = sysfs.addDevice("broken", MAX_BRIGHTNESS, 0);
+		FakeSysfs::setAttribute(broken, "max_brightness", "unknown\n");
+		SMOOTHER_CHECK(!SmootherSysfs::openDevice(device, broken.c_str()));
+		SMOOTHER_CHECK(device.brightness < 0);
+
+		auto path = sysfs.addDevice("intel_backlight", MAX_BRIGHTNESS, 321);
+		SMOOTHER_CHECK(SmootherSysfs::openDevice(device, path.c_str()));
+		SMOOTHER_CHECK(device.maxBrightness == MAX_BRIGHTNESS);
+		uint32_t brightness = 0;
+		SMOOTHER_CHECK(SmootherSysfs::readBrightness(device, brightness) && brightness == 321);
+		SmootherSysfs::closeDevice(device);
+		SMOOTHER_CHECK(device.brightness < 0);
+	}
+
+	static void testParseRequest() {
+		uint32_t value = 0;
+		SMOOTHER_CHECK(SmootherSysfs::parseRequest("500", MAX_BRIGHTNESS, value) && value == 500);
+		SMOOTHER_CHECK(SmootherSysfs::parseRequest(" 7 \n", MAX_BRIGHTNESS, value) && value == 7);
+		SMOOTHER_CHECK(SmootherSysfs::parseRequest("25%\n", MAX_BRIGHTNESS, value) && value == 250);
+		SMOOTHER_CHECK(SmootherSysfs::parseRequest("100%", 937, value) && value == 937);
+		SMOOTHER_CHECK(SmootherSysfs::parseRequest("2000", MAX_BRIGHTNESS, value) && value == MAX_BRIGHTNESS);
+		SMOOTHER_CHECK(!SmootherSysfs::parseRequest("101%", MAX_BRIGHTNESS, value));
+		SMOOTHER_CHECK(!SmootherSysfs::parseRequest("", MAX_BRIGHTNESS, value));
+		SMOOTHER_CHECK(!SmootherSysfs::parseRequest("-5", MAX_BRIGHTNESS, value));
+		SMOOTHER_CHECK(!SmootherSysfs::parseRequest("5x", MAX_BRIGHTNESS, value));
+		SMOOTHER_CHECK(!SmootherSysfs::parseRequest("99999999999", MAX_BRIGHTNESS, value));
+	}
+
+	// Requests fade through the brightness attribute on the smoothing timer and end exactly on the target.
+	static void testFades(uint32_t maxBrightness) {
+		reset();
+		SmootherSysfs::install();
+		FakeSysfs sysfs;
+		auto path = sysfs.addDevice("intel_backlight", maxBrightness, maxBrightness / 5);
+		SmootherSysfs::Device device;
+		SMOOTHER_CHECK(SmootherSysfs::openDevice(device, path.c_str()));
+
+		// Attaching keeps the current brightness.
+		SmootherSysfs::attach(device);
+		SMOOTHER_CHECK(FakeSysfs::attribute(path, "brightness") == maxBrightness / 5);
+		SMOOTHER_CHECK(!timerArmed);
+
+		uint32_t writes = device.writes;
+		uint32_t target = maxBrightness / 5 * 4;
+		SmootherSysfs::request(device, target);
+		SMOOTHER_CHECK(device.writes == writes);
+		SMOOTHER_CHECK(timerArmed);
+		auto up = fade(path);
+		SMOOTHER_CHECK(up.size() > 4);
+		SMOOTHER_CHECK(!up.empty() && up.back() == target);
+		for (size_t i = 1; i < up.size(); i++) {
+			SMOOTHER_CHECK(up[i] > up[i - 1]);
+		}
+		SMOOTHER_CHECK(device.writes - writes == up.size());
+
+		// Clamped to max_brightness, then all the way down.
+		SmootherSysfs::request(device, maxBrightness * 2);
+		auto full = fade(path);
+		SMOOTHER_CHECK(!full.empty() && full.back() == maxBrightness);
+		SmootherSysfs::request(device, 0);
+		auto down = fade(path);
+		SMOOTHER_CHECK(down.size() > 4 && down.back() == 0);
+		for (size_t i = 1; i < down.size(); i++) {
+			SMOOTHER_CHECK(down[i] < down[i - 1]);
+		}
+		SMOOTHER_CHECK(device.failedWrites == 0);
+		SmootherSysfs::closeDevice(device);
+	}
+
+	// A rejected write is counted and the fade goes on.
+	static void testFailedWrites() {
+		reset();
+		SmootherSysfs::install();
+		FakeSysfs sysfs;
+		auto path = sysfs.addDevice("intel_backlight", MAX_BRIGHTNESS, 100);
+		SmootherSysfs::Device device;
+		SMOOTHER_CHECK(SmootherSysfs::openDevice(device, path.c_str()));
+		SmootherSysfs::attach(device);
+
+		// Swap in a descriptor that cannot be written.
+		int writable = device.brightness;
+		device.brightness = open((path + "/brightness").c_str(), O_RDONLY);
+		uint32_t writes = device.writes;
+		SmootherSysfs::request(device, 900);
+		runUntilIdle();
+		SMOOTHER_CHECK(device.failedWrites > 0 && device.failedWrites == device.writes - writes);
+		SMOOTHER_CHECK(FakeSysfs::attribute(path, "brightness") == 100);
+		SmootherSysfs::closeDevice(device);
+		close(writable);
+	}
+}
+
+int main() {
+	testFindDevice();
+	testOpenDevice();
+	testParseRequest();
+	testFades(MAX_BRIGHTNESS);
+	testFades(96000);
+	testFades(15);
+	testFailedWrites();
+	return finish("test_sysfs");
+}
@@ -0,0 +1,69 @@
+//
+//  test_tables.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+using namespace SmootherHarness;
+using SmootherCore::STEPS;
+
+namespace {
+	// The floating point generator the integer one replaced.
+	static uint32_t legacyDuty(uint32_t frequency, uint32_t step) {
+		double a = static_cast<double>(frequency - SmootherCore::START_VALUE) / static_cast<double>(STEPS * STEPS);
+		return static_cast<uint32_t>(a * step * step + SmootherCore::START_VALUE + 0.5f);
+	}
+
+	static void testQuadraticDuty() {
+		uint64_t checked = 0, mismatches = 0;
+		for (uint64_t frequency = SmootherCore::START_VALUE; frequency <= UINT32_MAX; frequency += frequency < 300000 ? 1 : 65537) {
+			for (uint32_t step = 0; step < STEPS; step++) {
+				mismatches += SmootherCore::quadraticDuty(static_cast<uint32_t>(frequency), step) != legacyDuty(static_cast<uint32_t>(frequency), step);
+				checked++;
+			}
+		}
+		SMOOTHER_CHECK(mismatches == 0);
+		printf("test_tables: %llu entries compared with the floating point generator\n", static_cast<unsigned long long>(checked));
+	}
+
+	// Prebuilt and generated tables alike match the old generator, common maxima need no computation.
+	static void testGeneratedTables() {
+		static constexpr uint32_t prebuilt[] {SmootherCore::FallbackTargetBacklightFrequency, 0x56C, 0x710, 0x7A1, 0xAD9, 0xFFFF};
+		static constexpr uint32_t generated[] {0x400, 0x1000, 0x12345, 1000000};
+
+		reset();
+		MockController mock;
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		auto isGenerated = [&controller] {
+			auto table = controller.dutyTable;
+			return table == &controller.generatedTables[0] || table == &controller.generatedTables[1];
+		};
+
+		for (auto frequency : prebuilt) {
+			controller.targetBacklightFrequency = frequency;
+			SmootherCore::generateTables(controller);
+			SMOOTHER_CHECK(!isGenerated());
+			for (uint32_t step = 0; step < STEPS; step++) {
+				SMOOTHER_CHECK(controller.dutyTable->values[step] == legacyDuty(frequency, step));
+			}
+		}
+
+		for (auto frequency : generated) {
+			controller.targetBacklightFrequency = frequency;
+			SmootherCore::generateTables(controller);
+			SMOOTHER_CHECK(isGenerated());
+			for (uint32_t step = 0; step < STEPS; step++) {
+				SMOOTHER_CHECK(controller.dutyTable->values[step] == legacyDuty(frequency, step));
+			}
+		}
+	}
+}
+
+int main() {
+	testQuadraticDuty();
+	testGeneratedTables();
+	return finish("test_tables");
+}
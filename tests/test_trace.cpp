@@ -0,0 +1,147 @@
+//
+//  test_trace.cpp
+//  AppleBacklightSmoother
+//
+//  Copyright © 2020 Le Bao Hiep. All rights reserved.
+//
+
+#include "harness.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace SmootherHarness;
+
+namespace {
+	static constexpr uint32_t FIRMWARE_FREQUENCY = 0x56C;
+	static constexpr auto STRESS_TIME = std::chrono::milliseconds(500);
+
+	static std::vector<uint8_t> dump() {
+		std::vector<uint8_t> buffer(SmootherCore::traceDumpSize());
+		buffer.resize(SmootherCore::dumpTrace(buffer.data(), buffer.size()));
+		return buffer;
+	}
+
+	static const SmootherTraceHeader &headerOf(const std::vector<uint8_t> &buffer) {
+		return *reinterpret_cast<const SmootherTraceHeader *>(buffer.data());
+	}
+
+	static const SmootherTraceRecord *recordsOf(const std::vector<uint8_t> &buffer) {
+		return reinterpret_cast<const SmootherTraceRecord *>(buffer.data() + sizeof(SmootherTraceHeader));
+	}
+
+	// A fade is dumped in order with consecutive sequence numbers, the timer records match the hardware writes.
+	static void testFadeDump(const std::string &path) {
+		reset();
+		SmootherCore::traceEnabled = true;
+		MockController controller;
+		controller.registers[BXT_BLC_PWM_FREQ1] = FIRMWARE_FREQUENCY;
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_FREQ1, 0xFFFF);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x1000);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0xC000);
+		advance(30 * MS);
+		write<CflRealBacklightTraits>(controller, BXT_BLC_PWM_DUTY1, 0x4000);
+		runUntilIdle();
+
+		auto buffer = dump();
+		auto &header = headerOf(buffer);
+		auto records = recordsOf(buffer);
+		SMOOTHER_CHECK(header.magic == SmootherCore::TraceMagic && header.version == SmootherCore::TraceVersion);
+		SMOOTHER_CHECK(header.recordSize == sizeof(SmootherTraceRecord) && header.lostCount == 0);
+		SMOOTHER_CHECK(buffer.size() == sizeof(SmootherTraceHeader) + header.recordCount * sizeof(SmootherTraceRecord));
+
+		uint32_t driver = 0;
+		std::vector<uint32_t> timer;
+		for (uint32_t i = 0; i < header.recordCount; i++) {
+			SMOOTHER_CHECK(records[i].sequence == i + 1);
+			SMOOTHER_CHECK(i == 0 || records[i].timestamp >= records[i - 1].timestamp);
+			if (records[i].source == TraceSource::Driver) {
+				driver++;
+			} else {
+				timer.push_back(records[i].value);
+			}
+		}
+		SMOOTHER_CHECK(driver == 4);
+		std::vector<uint32_t> written;
+		for (auto &write : controller.writes) {
+			if (write.reg == BXT_BLC_PWM_DUTY1) {
+				written.push_back(write.value);
+			}
+		}
+		// The first duty write goes straight through without a timer record.
+		SMOOTHER_CHECK(!written.empty() && std::vector<uint32_t>(written.begin() + 1, written.end()) == timer);
+
+		// Kept for replay_trace, which make check runs on it.
+		FILE *file = fopen(path.c_str(), "wb");
+		SMOOTHER_CHECK(file && fwrite(buffer.data(), buffer.size(), 1, file) == 1);
+		if (file) {
+			fclose(file);
+		}
+	}
+
+	// Once the ring wrapped, the dump starts at the oldest record still there.
+	static void testWrappedDump() {
+		reset();
+		SmootherCore::traceEnabled = true;
+		MockController mock;
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		uint32_t total = SmootherCore::TRACE_RECORDS + 100;
+		for (uint32_t i = 0; i < total; i++) {
+			SmootherCore::traceRegister(TraceSource::Driver, controller, BXT_BLC_PWM_DUTY1, i, 0);
+		}
+
+		auto buffer = dump();
+		auto &header = headerOf(buffer);
+		auto records = recordsOf(buffer);
+		SMOOTHER_CHECK(header.recordCount == SmootherCore::TRACE_RECORDS && header.lostCount == 100);
+		for (uint32_t i = 0; i < header.recordCount; i++) {
+			SMOOTHER_CHECK(records[i].sequence == header.lostCount + i + 1 && records[i].value == header.lostCount + i);
+		}
+	}
+
+	// Dumps taken while another thread traces never contain a record mixing two writes.
+	static void testConcurrentDump() {
+		reset();
+		SmootherCore::traceEnabled = true;
+		MockController mock;
+		auto &controller = *SmootherCore::controllerFor(&mock);
+		std::atomic<bool> stop {false};
+		std::thread writer([&controller, &stop] {
+			for (uint32_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+				SmootherCore::traceRegister(TraceSource::Timer, controller, i * 3, i, ~i);
+				if ((i & 0xff) == 0) {
+					std::this_thread::yield();
+				}
+			}
+		});
+
+		uint64_t dumps = 0, records = 0, torn = 0, unordered = 0;
+		auto end = std::chrono::steady_clock::now() + STRESS_TIME;
+		while (std::chrono::steady_clock::now() < end) {
+			auto buffer = dump();
+			auto &header = headerOf(buffer);
+			auto record = recordsOf(buffer);
+			for (uint32_t i = 0; i < header.recordCount; i++) {
+				torn += record[i].rescaled != ~record[i].value || record[i].reg != record[i].value * 3;
+				unordered += i > 0 && record[i].sequence <= record[i - 1].sequence;
+			}
+			records += header.recordCount;
+			dumps++;
+			std::this_thread::yield();
+		}
+		stop = true;
+		writer.join();
+
+		SMOOTHER_CHECK(torn == 0 && unordered == 0);
+		printf("test_trace: %llu dumps, %llu records checked\n", static_cast<unsigned long long>(dumps), static_cast<unsigned long long>(records));
+	}
+}
+
+int main(int, char **argv) {
+	testFadeDump(std::string(argv[0]) + ".bin");
+	testWrappedDump();
+	testConcurrentDump();
+	return finish("test_trace");
+}